@@ -20,18 +20,18 @@ int main(int argc, char *argv[]) {
 void *echo(void *arg) {
   UNUSED(arg);
 
-  char in[2048];
+  grn_stream *in = grn_stream_open(STDIN_FILENO);
 
-  int read = grn_read(STDIN_FILENO, in, 1024);
+  const char *line;
+  ssize_t length = grn_stream_read_until(in, '\n', &line);
 
-  while (read != 0) {
-    in[read - 1] = '\0';
-    printf("Thanks for this {%s}\n", in);
-    memset(in, 0, 2048);
-    read = grn_read(STDIN_FILENO, in, 1024);
+  while (length > 0) {
+    printf("Thanks for this {%.*s}\n", (int)length - 1, line);
+    length = grn_stream_read_until(in, '\n', &line);
   }
 
   printf("Ok, bye bye!\n");
+  grn_stream_close(in);
 
   return NULL;
 }
@@ -1,27 +1,27 @@
 #include "chloros.h"
 #include "utils.h"
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 void *handle(void *arg) {
-  int fd = *((int *)arg);
-  free(arg);
+  grn_stream *conn = grn_stream_open((int)(intptr_t)arg);
+  printf("accepted connection\n");
 
-  char in[2048];
+  const char *line;
+  ssize_t length = grn_stream_read_until(conn, '\n', &line);
 
-  int read = grn_read(fd, in, 1024);
-
-  while (read > 0) {
-    in[read] = '\n';
-    in[read + 1] = '\0';
-    printf("Got this {%s}\n", in);
-    memset(in, 0, 2048);
-    read = grn_read(fd, in, 1024);
+  while (length > 0) {
+    printf("Got this {%.*s}\n", (int)length - 1, line);
+    grn_stream_write(conn, line, length);
+    length = grn_stream_read_until(conn, '\n', &line);
   }
 
   printf("Connection over\n");
+  grn_stream_close(conn);
 
   return 0;
 }
@@ -50,13 +50,11 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
-  listen(listener, 0);
+  listen(listener, SOMAXCONN);
 
-  while (true) {
-    int conn = grn_accept(listener, NULL, NULL);
-    printf("accepted connection\n");
-    int *arg = malloc(sizeof(int));
-    *arg = conn;
-    grn_spawn(handle, (void *)arg);
-  }
+  grn_serve_opts opts = {.max_concurrency = 1024};
+  grn_listen_serve(listener, handle, &opts);
+
+  perror("grn_listen_serve");
+  return 1;
 }
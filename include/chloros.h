@@ -1,11 +1,14 @@
 #ifndef CHLOROS_H
 #define CHLOROS_H
 
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -36,6 +39,11 @@ typedef struct grn_context_struct {
   uint64_t rbp;
 } grn_context;
 
+/*
+ * A set of threads sharing a CPU allowance, see grn_group_create().
+ */
+typedef struct grn_group_struct grn_group;
+
 typedef struct grn_thread_struct {
   int64_t id;
   grn_status status;
@@ -47,6 +55,26 @@ typedef struct grn_thread_struct {
   struct grn_thread_struct *waiting;
   volatile uint16_t preempt_count;
   volatile bool should_reschedule;
+  void *(*fn)(void *);
+  bool painted;
+  uint32_t budget;
+  bool detached;
+  void (*on_exit)(void *);
+  void *on_exit_arg;
+  bool interposed;
+  int priority;
+  bool in_rq;
+  uint64_t rq_enqueued;
+  struct grn_thread_struct *rq_prev;
+  struct grn_thread_struct *rq_next;
+  struct grn_thread_struct *rq_child;
+  uint64_t vruntime;
+  uint64_t runtime;
+  uint64_t run_start;
+  grn_group *group;
+  bool rq_held;
+  struct grn_thread_struct *wg_next;
+  struct grn_coro_struct *coro;
 } grn_thread;
 
 /*
@@ -54,8 +82,72 @@ typedef struct grn_thread_struct {
  */
 typedef void *(*grn_fn)(void *);
 
+/*
+ * Priority levels, lower is more urgent.
+ */
+#define GRN_PRIO_LEVELS 8
+#define GRN_PRIO_HIGHEST 0
+#define GRN_PRIO_DEFAULT 4
+#define GRN_PRIO_LOWEST (GRN_PRIO_LEVELS - 1)
+
+/*
+ * A scheduling policy, see grn_set_policy(). The policy keeps the READY
+ * threads, other than the running one, and decides which runs next. It may use
+ * the rq_prev, rq_next, rq_child and vruntime fields of the threads it holds.
+ */
+typedef struct grn_policy_struct {
+  const char *name;
+
+  /* Queues a READY thread, `front` if it was just spawned and should run soon */
+  void (*enqueue)(grn_thread *, bool);
+  /* Takes a queued thread out */
+  void (*remove)(grn_thread *);
+  /* Returns the queued thread to run next, leaving it queued */
+  grn_thread *(*pick_next)();
+
+  /* Optional, NULL if unused. The running thread parks */
+  void (*on_block)(grn_thread *);
+  /* Optional. A parked thread was woken, just before it's queued */
+  void (*on_wake)(grn_thread *);
+  /* Optional. A thread ran for the given nanoseconds, called when it's switched out */
+  void (*on_tick)(grn_thread *, uint64_t);
+} grn_policy;
+
+extern const grn_policy grn_policy_priority;
+extern const grn_policy grn_policy_fifo;
+extern const grn_policy grn_policy_lifo;
+extern const grn_policy grn_policy_fair;
+
+/*
+ * The default CPU shares of a group, which a single thread outside any group
+ * gets too.
+ */
+#define GRN_GROUP_SHARES_DEFAULT 1024
+
+/*
+ * Usage counters of a grn_group, times in nanoseconds.
+ */
+typedef struct {
+  uint64_t runtime;
+  uint64_t throttled_time;
+  uint64_t throttle_count;
+  uint32_t threads;
+  bool throttled;
+} grn_group_stats;
+
 void grn_init(bool);
+void grn_init_policy(bool, const grn_policy *);
 int grn_spawn(grn_fn, void *);
+int grn_spawn_prio(grn_fn, void *, int);
+int grn_set_priority(grn_thread *, int);
+void grn_set_aging(uint32_t);
+int grn_set_policy(const grn_policy *);
+void grn_set_run_next(uint32_t);
+grn_group *grn_group_create(uint32_t);
+int grn_group_set_quota(grn_group *, uint64_t, uint64_t);
+int grn_group_destroy(grn_group *);
+void grn_group_get_stats(const grn_group *, grn_group_stats *);
+int grn_spawn_group(grn_group *, grn_fn, void *);
 int grn_yield();
 int grn_wait();
 grn_thread *grn_current();
@@ -73,11 +165,167 @@ void chloros_free(void *);
 // read()/write() syscall wrappers
 ssize_t grn_read(int, void *, size_t);
 ssize_t grn_write(int, const void *, size_t);
+int grn_close(int);
+
+// Scatter/gather and message wrappers
+ssize_t grn_readv(int, const struct iovec *, int);
+ssize_t grn_writev(int, const struct iovec *, int);
+ssize_t grn_recvmsg(int, struct msghdr *, int);
+ssize_t grn_sendmsg(int, const struct msghdr *, int);
+
+// Datagram wrappers, the batched ones move up to N datagrams per syscall
+struct mmsghdr;
+ssize_t grn_recvfrom(int, void *, size_t, int, struct sockaddr *, socklen_t *);
+ssize_t grn_sendto(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+int grn_recvmmsg(int, struct mmsghdr *, unsigned int, int);
+int grn_sendmmsg(int, struct mmsghdr *, unsigned int, int);
+
+// Zero-copy wrappers, and a pool of pipes to splice through
+ssize_t grn_sendfile(int, int, off_t *, size_t);
+ssize_t grn_splice(int, int64_t *, int, int64_t *, size_t, unsigned int);
+ssize_t grn_tee(int, int, size_t, unsigned int);
+int grn_pipe_acquire(int[2]);
+void grn_pipe_release(int[2]);
+ssize_t grn_splice_copy(int, int, size_t);
+
+// Accept loop that spawns a detached thread per connection
+typedef struct grn_serve_opts_struct {
+  /**
+   * most handlers running at once, 0 for no limit
+   */
+  int max_concurrency;
+
+  /**
+   * most connections accepted before yielding to the new handlers, 0 to
+   * drain the backlog on every wakeup
+   */
+  int max_batch;
+} grn_serve_opts;
+
+int grn_listen_serve(int, grn_fn, const grn_serve_opts *);
+
+// Parks the current thread for a while
+int grn_nanosleep(const struct timespec *, struct timespec *);
+
+/*
+ * Lets another kernel thread wake a parked green thread. A wake that comes
+ * before the park isn't lost, the next grn_park() returns right away.
+ */
+typedef struct grn_waker_struct {
+  int state;
+  grn_thread *thread;
+  /* The scheduler of the parked thread */
+  struct chloros_state_struct *owner;
+  struct grn_waker_struct *next;
+} grn_waker;
 
-// accept() wrapper
+// Thread-safe entry points for kernel threads other than the scheduler's
+void grn_waker_init(grn_waker *);
+void grn_park(grn_waker *);
+void grn_wake(grn_waker *);
+int grn_spawn_external(grn_fn, void *);
+
+/*
+ * Counts outstanding work, e.g. threads, that other threads can wait for, see
+ * grn_waitgroup_wait(). A zeroed grn_waitgroup is initialized.
+ */
+typedef struct grn_waitgroup_struct {
+  int count;
+  uint64_t generation;
+  grn_thread *waiters;
+} grn_waitgroup;
+
+/*
+ * The threads started with grn_scope_spawn(), which grn_scope_wait() waits for.
+ */
+typedef struct grn_scope_struct {
+  grn_waitgroup wg;
+} grn_scope;
+
+void grn_waitgroup_init(grn_waitgroup *);
+void grn_waitgroup_add(grn_waitgroup *, int);
+void grn_waitgroup_done(grn_waitgroup *);
+void grn_waitgroup_wait(grn_waitgroup *);
+void grn_scope_init(grn_scope *);
+int grn_scope_spawn(grn_scope *, grn_fn, void *);
+void grn_scope_wait(grn_scope *);
+
+/*
+ * The result of a computation that may not have finished yet, see grn_async().
+ */
+typedef struct grn_future_struct grn_future;
+
+grn_future *grn_async(grn_fn, void *);
+grn_future *grn_future_create();
+int grn_future_resolve(grn_future *, void *);
+void grn_future_release(grn_future *);
+void *grn_await(grn_future *);
+int grn_await_any(grn_future **, int);
+void grn_await_all(grn_future **, int);
+
+/*
+ * A coroutine running on the stack of its own but on the green thread that
+ * resumes it, see grn_coro_create().
+ */
+typedef struct grn_coro_struct grn_coro;
+
+grn_coro *grn_coro_create(grn_fn, void *);
+void *grn_coro_resume(grn_coro *, void *);
+void *grn_coro_yield(void *);
+bool grn_coro_done(grn_coro *);
+void grn_coro_destroy(grn_coro *);
+
+// Shared-nothing mode, one scheduler per CPU exchanging work by message
+int grn_shard_run(int, bool, grn_fn, void *);
+int grn_shard_id();
+int grn_shard_count();
+int grn_shard_submit(int, grn_fn, void *);
+int grn_listen_reuseport(const struct sockaddr *, socklen_t, int);
+
+// Runs a blocking call on a kernel thread pool while the caller is parked
+void *grn_offload(grn_fn, void *);
+
+// Buffered streams over an fd
+#define GRN_STREAM_BUFFER_SIZE 16384
+
+typedef struct grn_stream_struct grn_stream;
+
+grn_stream *grn_stream_open(int);
+int grn_stream_close(grn_stream *);
+ssize_t grn_stream_peek(grn_stream *, size_t, const char **);
+ssize_t grn_stream_read_exact(grn_stream *, size_t, const char **);
+ssize_t grn_stream_read_until(grn_stream *, char, const char **);
+ssize_t grn_stream_write(grn_stream *, const void *, size_t);
+int grn_stream_flush(grn_stream *);
+
+// accept()/connect() wrappers
 int grn_accept(int, struct sockaddr *, socklen_t *);
+int grn_connect(int, const struct sockaddr *, socklen_t);
+
+// poll() wrapper, waits on several fds at once
+int grn_poll(struct pollfd *, nfds_t, int);
+
+// Number of I/O calls a thread may complete without blocking before it yields
+void grn_set_coop_budget(uint32_t);
+
+// Polling for events for a while before sleeping when every thread is waiting
+void grn_set_idle_spin(uint32_t);
+void grn_set_busy_poll(uint32_t);
+
+// SIGPROF sampling profiler with folded-stack output
+int grn_profile_start(int);
+void grn_profile_stop();
+void grn_profile_dump(FILE *);
+
+// Stack high-water measurement
+void grn_stack_paint(bool);
+size_t grn_stack_usage(grn_thread *);
+void grn_stack_report(FILE *);
 
 // 1 << 20 == 1MB
 static const uint64_t STACK_SIZE = (1 << 20);
 
+// 1 << 16 == 64KB
+static const uint64_t CORO_STACK_SIZE = (1 << 16);
+
 #endif
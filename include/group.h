@@ -0,0 +1,41 @@
+#ifndef CHLOROS_GROUP_H
+#define CHLOROS_GROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chloros.h"
+#include "timer.h"
+
+/**
+ * A set of threads that share a CPU allowance, see grn_group_create().
+ */
+struct grn_group_struct {
+  uint32_t shares;
+  uint32_t threads;
+
+  /* CPU time in nanoseconds allowed per period, 0 for no quota */
+  uint64_t quota;
+  uint64_t period;
+  uint64_t period_start;
+  uint64_t period_used;
+
+  /**
+   * true while the group has used up its quota, its READY threads wait on
+   * `held` until `refill` fires at the end of the period
+   */
+  bool throttled;
+  grn_thread *held;
+  grn_timer refill;
+  uint64_t throttled_since;
+
+  uint64_t runtime;
+  uint64_t throttled_time;
+  uint64_t throttle_count;
+};
+
+void grn_group_charge(grn_group *, uint64_t, uint64_t);
+bool grn_group_hold(grn_thread *);
+bool grn_group_release(grn_thread *);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CHLOROS_INBOX_H
+#define CHLOROS_INBOX_H
+
+#include <stdbool.h>
+
+#include "chloros.h"
+
+/**
+ * A grn_spawn_external() request on its way to the scheduler.
+ */
+typedef struct grn_inbox_spawn_struct {
+  grn_fn fn;
+  void *arg;
+  struct grn_inbox_spawn_struct *next;
+} grn_inbox_spawn;
+
+struct chloros_state_struct;
+
+void grn_inbox_init();
+bool grn_inbox_event(int);
+int grn_inbox_spawn_on(struct chloros_state_struct *, grn_fn, void *);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef CHLOROS_IO_H
+#define CHLOROS_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chloros.h"
+#include "thread.h"
+
+/**
+ * Everything the scheduler knows about a file descriptor threads wait on.
+ *
+ * Each fd is added to the epoll set once, with EPOLLONESHOT, and re-armed for
+ * the union of the directions that still have waiters each time it fires.
+ * Readers and writers queue separately, so one thread can be parked reading
+ * a socket while another is parked writing to it.
+ */
+typedef struct grn_fd_record_struct {
+  int fd;
+
+  /**
+   * true once the fd has been added to the epoll set
+   */
+  bool registered;
+
+  /**
+   * false if epoll refused the fd, e.g. a regular file, which is always ready
+   */
+  bool pollable;
+
+  /**
+   * device and inode of the file epoll refused, so a later fd with the same
+   * number, e.g. a socket after the file was close()d, isn't taken for it
+   */
+  dev_t dev;
+  ino_t ino;
+
+  /**
+   * true if the refused fd is a regular file or a block device, whose calls
+   * block on the disk and go to the offload pool
+   */
+  bool disk;
+
+  /**
+   * threads parked until the fd is readable/writable
+   */
+  grn_waitq readers;
+  grn_waitq writers;
+
+  /**
+   * bumped by grn_close(), so the threads it wakes can tell the fd they were
+   * parked on is gone rather than ready
+   */
+  uint32_t generation;
+} grn_fd_record;
+
+/*
+ * What grn_fd_wait() returns when the fd was closed with grn_close() while the
+ * thread was parked.
+ */
+#define GRN_FD_CLOSED 1
+
+int grn_fd_wait(int, uint32_t);
+void grn_fd_ready(int, uint32_t);
+
+#endif
@@ -2,9 +2,32 @@
 #define CHLOROS_MAIN_H
 
 #include "chloros.h"
+#include "group.h"
+#include "io.h"
+#include "inbox.h"
+#include "offload.h"
+#include "runq.h"
+#include "shard.h"
+#include "timer.h"
+
+/*
+ * The most idle pipes kept for reuse by the pipe pool.
+ */
+#define PIPE_POOL_SIZE 16
+
+/*
+ * The most idle grn_stream buffers kept for reuse.
+ */
+#define STREAM_POOL_SIZE 64
+
+/*
+ * The most stacks of destroyed coroutines kept for reuse.
+ */
+#define CORO_POOL_SIZE 32
 
 /**
- * This structure keeps track of the global state for the green threads library.
+ * This structure keeps track of the state of a scheduler. Each kernel thread
+ * running green threads has its own, see shard.c.
  */
 typedef struct chloros_state_struct {
   /**
@@ -38,13 +61,143 @@ typedef struct chloros_state_struct {
    */
   int epfd;
 
+  /**
+   * whether new stacks are painted so their high-water mark can be measured
+   */
+  bool paint_stacks;
+
+  /**
+   * how many grn_* I/O calls may complete without parking before the calling
+   * thread is made to yield, 0 disables the budget
+   */
+  uint32_t coop_budget;
+
+  /**
+   * wait records of the fds threads have parked on, indexed by fd
+   */
+  grn_fd_record **fd_records;
+  int fd_records_size;
+
+  /**
+   * armed timers of parked threads, sorted by deadline
+   */
+  grn_timer *timers;
+  grn_timer *timers_tail;
+
+  /**
+   * empty pipes kept around for grn_splice_copy() and grn_pipe_acquire()
+   */
+  int pipe_pool[PIPE_POOL_SIZE][2];
+  int pipe_pool_count;
+
+  /**
+   * free grn_stream buffers
+   */
+  char *stream_buffers[STREAM_POOL_SIZE];
+  int stream_buffer_count;
+
+  /**
+   * destroyed coroutines, with their stacks, see coro.c
+   */
+  grn_coro *coro_pool[CORO_POOL_SIZE];
+  int coro_pool_count;
+
+  /**
+   * work handed over by other kernel threads, see inbox.c
+   */
+  int inbox_fd;
+  grn_inbox_spawn *inbox_spawns;
+  grn_waker *inbox_wakes;
+
+  /**
+   * grn_offload() calls of this scheduler's threads that haven't returned,
+   * whose workers still hold wakers pointing at this STATE, and woken when
+   * the last of them does, see grn_shard_main()
+   */
+  int offload_jobs;
+  grn_waker offload_idle;
+
+  /**
+   * grn_policy_priority's READY threads, one FIFO queue per priority level,
+   * and a bit per non-empty level. FIFO and LIFO use level 0
+   */
+  grn_thread *rq_heads[GRN_PRIO_LEVELS];
+  grn_thread *rq_tails[GRN_PRIO_LEVELS];
+  uint32_t rq_bitmap;
+
+  /**
+   * scheduling decisions made so far, and how many a READY thread may be
+   * passed over before aging runs it anyway (0 for no aging)
+   */
+  uint64_t rq_picks;
+  uint32_t rq_aging;
+
+  /**
+   * the scheduling policy and how many threads it holds
+   */
+  const grn_policy *rq_policy;
+  uint32_t rq_count;
+
+  /**
+   * the most recently woken thread, which runs ahead of the policy's choice
+   * for up to rq_run_next_limit picks in a row (0 disables the slot)
+   */
+  grn_thread *rq_run_next;
+  uint32_t rq_run_next_limit;
+  uint32_t rq_run_next_streak;
+
+  /**
+   * grn_policy_fair's pairing heap of READY threads ordered by vruntime, it
+   * never lets a thread's vruntime fall behind rq_min_vruntime
+   */
+  grn_thread *rq_root;
+  uint64_t rq_min_vruntime;
+
+  /**
+   * how long the scheduler polls for events before blocking when no thread is
+   * READY, in microseconds: the current window, which adapts to whether spins
+   * find something, and the most it can grow to (0 disables spinning)
+   */
+  uint32_t spin_us;
+  uint32_t spin_max_us;
+
+  /**
+   * SO_BUSY_POLL value given to the sockets threads park on, 0 for none
+   */
+  uint32_t busy_poll_us;
+
+  /**
+   * the shard this scheduler is, NULL outside grn_shard_run()
+   */
+  grn_shard *shard;
+
 } chloros_state;
 
-extern chloros_state STATE;
+extern __thread chloros_state STATE;
+
+/*
+ * The scheduler grn_spawn_external() hands threads to: the last one started by
+ * grn_init() outside of a shard.
+ */
+extern chloros_state *grn_home_state;
+
+/*
+ * true on the kernel thread that called grn_init() and runs the green threads.
+ * Other kernel threads (the offload pool, foreign pthreads) must not touch
+ * STATE, preempt_count included.
+ */
+extern __thread bool grn_scheduler_thread;
 
 void grn_gc();
 void grn_epoll(int timeout);
+grn_thread *grn_create(grn_fn, void *, int, grn_group *);
+int grn_start(grn_thread *);
 
 #define MAX_EVENTS 16
 
+/*
+ * The default cooperative budget, see grn_set_coop_budget().
+ */
+#define COOP_BUDGET 128
+
 #endif
@@ -0,0 +1,9 @@
+#ifndef CHLOROS_OFFLOAD_H
+#define CHLOROS_OFFLOAD_H
+
+/*
+ * The number of kernel threads running offloaded calls.
+ */
+#define OFFLOAD_WORKERS 4
+
+#endif
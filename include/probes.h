@@ -0,0 +1,69 @@
+#ifndef CHLOROS_PROBES_H
+#define CHLOROS_PROBES_H
+
+#include <stdint.h>
+
+/*
+ * USDT (SystemTap SDT) static tracepoints for the scheduler.
+ *
+ * Each probe compiles to a single `nop` plus an ELF note in the
+ * .note.stapsdt section that records the nop's address and where to find the
+ * probe's arguments. Tools like bpftrace, perf and systemtap patch the nop
+ * into a breakpoint only while they are attached, so a probe costs nothing
+ * but the nop when nobody is tracing, e.g.
+ *
+ *   bpftrace -e 'usdt:./server:chloros:switch_out { @[arg1] = count(); }'
+ *
+ * This is the same note layout <sys/sdt.h> emits, written out here so the
+ * library doesn't depend on systemtap headers being installed. All arguments
+ * are recorded as signed 64-bit values. Define CHLOROS_NO_PROBES to compile
+ * the probes out entirely.
+ */
+#ifdef CHLOROS_NO_PROBES
+
+#define GRN_PROBE0(name) do { } while (0)
+#define GRN_PROBE1(name, a) do { UNUSED(a); } while (0)
+#define GRN_PROBE2(name, a, b) do { UNUSED(a); UNUSED(b); } while (0)
+#define GRN_PROBE3(name, a, b, c) do { UNUSED(a); UNUSED(b); UNUSED(c); } while (0)
+
+#else
+
+#define GRN_PROBE_ARG(x) "nor"((int64_t)(x))
+
+#define GRN_PROBE_NOTE(name, args, ...)                                      \
+  __asm__ __volatile__(                                                      \
+      "990: nop\n"                                                           \
+      ".pushsection .note.stapsdt,\"?\",\"note\"\n"                          \
+      ".balign 4\n"                                                          \
+      ".4byte 992f-991f, 994f-993f, 3\n"                                     \
+      "991: .asciz \"stapsdt\"\n"                                            \
+      "992: .balign 4\n"                                                     \
+      "993: .8byte 990b\n"                                                   \
+      ".8byte _.stapsdt.base\n"                                              \
+      ".8byte 0\n"                                                           \
+      ".asciz \"chloros\"\n"                                                 \
+      ".asciz \"" #name "\"\n"                                               \
+      ".asciz \"" args "\"\n"                                                \
+      "994: .balign 4\n"                                                     \
+      ".popsection\n"                                                        \
+      ".ifndef _.stapsdt.base\n"                                             \
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+      ".weak _.stapsdt.base\n"                                               \
+      ".hidden _.stapsdt.base\n"                                             \
+      "_.stapsdt.base: .space 1\n"                                           \
+      ".size _.stapsdt.base, 1\n"                                            \
+      ".popsection\n"                                                        \
+      ".endif\n"                                                             \
+      ::__VA_ARGS__)
+
+#define GRN_PROBE0(name) GRN_PROBE_NOTE(name, "", )
+#define GRN_PROBE1(name, a) GRN_PROBE_NOTE(name, "-8@%0", GRN_PROBE_ARG(a))
+#define GRN_PROBE2(name, a, b) \
+  GRN_PROBE_NOTE(name, "-8@%0 -8@%1", GRN_PROBE_ARG(a), GRN_PROBE_ARG(b))
+#define GRN_PROBE3(name, a, b, c)                                   \
+  GRN_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2", GRN_PROBE_ARG(a), GRN_PROBE_ARG(b), \
+                 GRN_PROBE_ARG(c))
+
+#endif
+
+#endif
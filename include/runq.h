@@ -0,0 +1,27 @@
+#ifndef CHLOROS_RUNQ_H
+#define CHLOROS_RUNQ_H
+
+#include <stdbool.h>
+
+#include "chloros.h"
+
+/*
+ * Run queues. Every READY thread other than the one running is held by the
+ * scheduling policy, STATE.rq_policy, unless its group is throttled.
+ */
+void grn_rq_enqueue(grn_thread *, bool);
+void grn_rq_remove(grn_thread *);
+grn_thread *grn_rq_pick();
+bool grn_rq_empty();
+void grn_rq_block(grn_thread *);
+void grn_rq_wake(grn_thread *);
+const grn_policy *grn_policy_from_env();
+
+/*
+ * CPU accounting for the policy's on_tick and for thread groups, done by
+ * grn_yield() when it switches threads. Both do nothing if neither needs it.
+ */
+void grn_rq_charge(grn_thread *);
+void grn_rq_start(grn_thread *);
+
+#endif
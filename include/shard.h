@@ -0,0 +1,31 @@
+#ifndef CHLOROS_SHARD_H
+#define CHLOROS_SHARD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "chloros.h"
+
+/**
+ * One of the schedulers started by grn_shard_run(), each on its own kernel
+ * thread with its own STATE.
+ */
+typedef struct grn_shard_struct {
+  int id;
+  pthread_t thread;
+
+  /* The shard's STATE, set once its scheduler is initialized */
+  struct chloros_state_struct *state;
+
+  /**
+   * false once the shard stops taking work from grn_shard_submit(), which it
+   * only does after the calls in progress (`submitters`) are done
+   */
+  bool accepting;
+  int submitters;
+
+  /* Woken when every shard's function has returned */
+  grn_waker stopped;
+} grn_shard;
+
+#endif
@@ -6,6 +6,28 @@
 
 #include "chloros.h"
 
+/*
+ * A thread parked on some event. Waiters live on the parked thread's stack and
+ * are linked into a grn_waitq for as long as the thread waits.
+ */
+typedef struct grn_waiter_struct {
+  grn_thread *thread;
+  /* The events waited for, and the ones that woke the thread */
+  uint32_t events;
+  uint32_t revents;
+  struct grn_waitq_struct *queue;
+  struct grn_waiter_struct *prev;
+  struct grn_waiter_struct *next;
+} grn_waiter;
+
+/*
+ * A FIFO queue of waiters.
+ */
+typedef struct grn_waitq_struct {
+  grn_waiter *head;
+  grn_waiter *tail;
+} grn_waitq;
+
 /*
  * Thread lookup and traversal.
  */
@@ -21,6 +43,14 @@ void remove_waiting_thread(grn_thread *);
 void move_thread_to_waiting(grn_thread *);
 void move_thread_to_active(grn_thread *);
 void move_thread_to_joinable(grn_thread *);
+void grn_wake_thread(grn_thread *);
+
+/*
+ * Wait queues.
+ */
+void grn_waitq_push(grn_waitq *, grn_waiter *);
+void grn_waitq_remove(grn_waiter *);
+grn_waiter *grn_waitq_wake_one(grn_waitq *, uint32_t);
 
 /*
  * Thread creation and destruction.
@@ -28,6 +58,12 @@ void move_thread_to_joinable(grn_thread *);
 grn_thread *grn_new_thread(bool);
 void grn_destroy_thread(grn_thread *);
 
+/*
+ * Stack painting and high-water accounting, implemented in stack.c.
+ */
+void grn_stack_fill(grn_thread *);
+void grn_stack_record(grn_thread *);
+
 /*
  * Pretty debug-printing for a thread structure.
  */
@@ -0,0 +1,33 @@
+#ifndef CHLOROS_TIMER_H
+#define CHLOROS_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chloros.h"
+
+/**
+ * A deadline a parked thread is waiting for. Timers live on the parked
+ * thread's stack and are kept in STATE.timers, sorted by deadline, while they
+ * are armed. When the deadline passes, the thread is woken and `fired` is set,
+ * or `on_fire` is called instead if it's set.
+ */
+typedef struct grn_timer_struct {
+  /* CLOCK_MONOTONIC time in nanoseconds */
+  uint64_t deadline;
+  grn_thread *thread;
+  void (*on_fire)(void *);
+  void *on_fire_arg;
+  bool armed;
+  bool fired;
+  struct grn_timer_struct *prev;
+  struct grn_timer_struct *next;
+} grn_timer;
+
+uint64_t grn_now();
+void grn_timer_add(grn_timer *, uint64_t);
+void grn_timer_remove(grn_timer *);
+int grn_timer_timeout(int);
+void grn_timer_fire();
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef CHLOROS_UTILS_H
 #define CHLOROS_UTILS_H
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 /*
  * The macros below are for debugging and printing out verbose output. They are
  * similar to the Linux debug macros in that defining DEBUG will enable debug
@@ -62,6 +67,37 @@
         }; \
     } while (0)
 
+/*
+ * The library's own calls to the functions libchloros_preload.so interposes
+ * (see src/preload.c). Inside the shared library they would bind to the
+ * interposed definitions and come back into the scheduler, e.g. the read() of
+ * the inbox eventfd turning into a grn_read() that disarms it, so they go
+ * straight to the kernel instead.
+ */
+static inline ssize_t grn_sys_read(int fd, void *buf, size_t count) {
+  return syscall(SYS_read, fd, buf, count);
+}
+
+static inline ssize_t grn_sys_write(int fd, const void *buf, size_t count) {
+  return syscall(SYS_write, fd, buf, count);
+}
+
+static inline int grn_sys_close(int fd) {
+  return syscall(SYS_close, fd);
+}
+
+static inline int grn_sys_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  return syscall(SYS_accept, fd, addr, addrlen);
+}
+
+static inline int grn_sys_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  return syscall(SYS_connect, fd, addr, addrlen);
+}
+
+static inline int grn_sys_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  return syscall(SYS_poll, fds, nfds, timeout);
+}
+
 /*
  * A simple macro that allows a variable to pass through unused checks even if
  * it is actually unused.
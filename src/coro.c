@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * Coroutines run on the green thread that resumes them: grn_coro_resume() and
+ * grn_coro_yield() are a single grn_context_switch() between the resumer's
+ * stack and the coroutine's, with no run queue, epoll or GC in between. The
+ * scheduler doesn't know about them. A coroutine that parks parks its resumer,
+ * and is preempted along with it.
+ */
+
+struct grn_coro_struct {
+  grn_context context;
+  /* Where the coroutine returns to when it yields */
+  grn_context caller;
+  uint8_t *stack;
+
+  grn_fn fn;
+  void *arg;
+
+  /* The value passed by the last resume or yield */
+  void *transfer;
+  bool done;
+
+  /* The coroutine that resumed this one, to restore when it yields */
+  grn_coro *parent;
+};
+
+/**
+ * First frame of a coroutine, entered by the context switch of its first
+ * resume. It has no caller to return to: once the function returns it
+ * switches back for good.
+ */
+static void grn_coro_entry() {
+  grn_coro *coro = STATE.current->coro;
+
+  coro->transfer = coro->fn(coro->arg);
+  coro->done = true;
+
+  grn_context_switch(&coro->context, &coro->caller);
+  err_exit("A finished coroutine was resumed\n");
+}
+
+/**
+ * Points `coro`'s context at the top of its stack, so the next switch to it
+ * enters grn_coro_entry(). The other registers are cleared, a pooled
+ * coroutine would otherwise start with the last one's, %rbp included.
+ */
+static void grn_coro_reset(grn_coro *coro) {
+  uint64_t *top = (uint64_t *)&coro->stack[CORO_STACK_SIZE];
+  memset(&coro->context, 0, sizeof(coro->context));
+
+  // Entered as if called: the return address slot is 16-byte aligned and
+  // holds 0, so unwinders stop at grn_coro_entry()
+  top[-1] = 0;
+  top[-2] = (uint64_t)grn_coro_entry;
+  coro->context.rsp = (uint64_t)&top[-2];
+
+  coro->done = false;
+  coro->parent = NULL;
+  coro->transfer = NULL;
+}
+
+/**
+ * Creates a coroutine that runs `fn(arg)` when it's first resumed. Its stack
+ * is CORO_STACK_SIZE bytes, much smaller than a thread's, and comes from a
+ * pool of the stacks of destroyed coroutines when there is one.
+ *
+ * @param fn the body of the coroutine, what it returns is the value of the
+ *           resume that finishes it
+ * @param arg the argument to pass to `fn`
+ *
+ * @return the coroutine, to be freed with grn_coro_destroy()
+ */
+grn_coro *grn_coro_create(grn_fn fn, void *arg) {
+  grn_coro *coro = NULL;
+
+  grn_preempt_disable();
+  if (STATE.coro_pool_count > 0) coro = STATE.coro_pool[--STATE.coro_pool_count];
+  grn_preempt_enable();
+
+  if (coro == NULL) {
+    coro = calloc(1, sizeof(grn_coro));
+    assert_malloc(coro);
+
+    int allocated = posix_memalign((void **)&coro->stack, 16, CORO_STACK_SIZE);
+    if (allocated != 0) err_exit("Couldn't allocate a coroutine stack\n");
+  }
+
+  coro->fn = fn;
+  coro->arg = arg;
+  grn_coro_reset(coro);
+
+  return coro;
+}
+
+/**
+ * Frees `coro`, whether or not it has finished. Its stack goes back to the
+ * pool, anything its body still had on it is dropped without unwinding.
+ */
+void grn_coro_destroy(grn_coro *coro) {
+  grn_preempt_disable();
+  if (STATE.coro_pool_count < CORO_POOL_SIZE) {
+    STATE.coro_pool[STATE.coro_pool_count++] = coro;
+    coro = NULL;
+  }
+  grn_preempt_enable();
+
+  if (coro == NULL) return;
+
+  free(coro->stack);
+  free(coro);
+}
+
+/**
+ * Runs `coro` until it yields or returns. The first resume starts its body,
+ * the following ones return `value` from the grn_coro_yield() it's stopped
+ * in. Coroutines can resume other coroutines.
+ *
+ * @param coro the coroutine to run
+ * @param value the value to pass in, ignored by the first resume
+ *
+ * @return the value the coroutine yielded or returned, or NULL with errno set
+ *         to EINVAL if it had already finished
+ */
+void *grn_coro_resume(grn_coro *coro, void *value) {
+  if (coro->done) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  grn_thread *thread = STATE.current;
+
+  coro->transfer = value;
+  coro->parent = thread->coro;
+  thread->coro = coro;
+
+  grn_context_switch(&coro->caller, &coro->context);
+
+  thread->coro = coro->parent;
+  return coro->transfer;
+}
+
+/**
+ * Suspends the running coroutine and returns `value` from the
+ * grn_coro_resume() that ran it.
+ *
+ * @param value the value to pass out
+ *
+ * @return the value passed to the next grn_coro_resume(), or NULL with errno
+ *         set to EPERM if the caller isn't a coroutine
+ */
+void *grn_coro_yield(void *value) {
+  grn_coro *coro = STATE.current->coro;
+  if (coro == NULL) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  coro->transfer = value;
+  grn_context_switch(&coro->context, &coro->caller);
+
+  return coro->transfer;
+}
+
+/**
+ * @return true if the body of `coro` has returned
+ */
+bool grn_coro_done(grn_coro *coro) {
+  return coro->done;
+}
@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * A future holds the list of threads awaiting it, one link per awaited
+ * future, so resolving it wakes exactly the threads that can make progress
+ * and nobody polls. A thread awaiting several futures counts down how many it
+ * still needs and is woken once, when that gets to 0. Futures belong to the
+ * scheduler they're used on, they can't be shared between shards.
+ */
+
+/**
+ * A thread parked in grn_await_any() or grn_await_all().
+ */
+typedef struct {
+  grn_thread *thread;
+  /* Futures still to resolve before the thread is woken */
+  int remaining;
+  /* Index of the first future that resolved, -1 if none has */
+  int first;
+} grn_future_waiter;
+
+/**
+ * A waiter's registration on one future.
+ */
+typedef struct grn_future_link_struct {
+  grn_future_waiter *waiter;
+  /* NULL once the future has resolved and dropped the link */
+  grn_future *future;
+  int index;
+  struct grn_future_link_struct *prev;
+  struct grn_future_link_struct *next;
+} grn_future_link;
+
+struct grn_future_struct {
+  bool resolved;
+  void *value;
+  /* The creator's reference, and the thread's for grn_async() futures */
+  int refs;
+  grn_future_link *links;
+};
+
+/**
+ * Creates an unresolved future, to be resolved with grn_future_resolve().
+ *
+ * @return the future, which the caller releases with grn_future_release()
+ */
+grn_future *grn_future_create() {
+  grn_future *future = calloc(1, sizeof(grn_future));
+  assert_malloc(future);
+  future->refs = 1;
+  return future;
+}
+
+/**
+ * Drops a reference to `future`, freeing it once its grn_async() thread, if
+ * any, is done with it too. It must not be awaited anymore.
+ */
+void grn_future_release(grn_future *future) {
+  grn_preempt_disable();
+  if (--future->refs == 0) free(future);
+  grn_preempt_enable();
+}
+
+/**
+ * Resolves `future` with `value` and wakes the threads awaiting it that have
+ * nothing else left to wait for.
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if it was already resolved
+ */
+int grn_future_resolve(grn_future *future, void *value) {
+  grn_preempt_disable();
+
+  if (future->resolved) {
+    grn_preempt_enable();
+    errno = EINVAL;
+    return -1;
+  }
+
+  future->resolved = true;
+  future->value = value;
+
+  grn_future_link *link = future->links;
+  future->links = NULL;
+
+  while (link != NULL) {
+    grn_future_link *next = link->next;
+    grn_future_waiter *waiter = link->waiter;
+
+    link->future = NULL;
+    if (waiter->first == -1) waiter->first = link->index;
+    if (waiter->remaining > 0 && --waiter->remaining == 0) grn_wake_thread(waiter->thread);
+
+    link = next;
+  }
+
+  grn_preempt_enable();
+  return 0;
+}
+
+/**
+ * Exit hook of grn_async() threads, runs with preemption disabled.
+ */
+static void grn_future_thread_exit(void *arg) {
+  grn_future *future = arg;
+  grn_future_resolve(future, STATE.current->return_value);
+  grn_future_release(future);
+}
+
+/**
+ * Runs `fn(arg)` in a new detached green thread and returns a future that
+ * resolves to what it returns, or passes to grn_exit(). The thread runs at the
+ * priority and in the group of the current thread, which yields to it like
+ * grn_spawn().
+ *
+ * @return the future, which the caller releases with grn_future_release()
+ */
+grn_future *grn_async(grn_fn fn, void *arg) {
+  grn_future *future = grn_future_create();
+
+  grn_preempt_disable();
+
+  grn_thread *thread = grn_create(fn, arg, STATE.current->priority, STATE.current->group);
+  thread->detached = true;
+  thread->on_exit = grn_future_thread_exit;
+  thread->on_exit_arg = future;
+  future->refs++;
+
+  grn_preempt_enable();
+
+  grn_start(thread);
+  return future;
+}
+
+/**
+ * Parks the current thread on the unresolved ones among `futures` until
+ * `all` of them, or any one of them, have resolved.
+ *
+ * @return the index of the first future that resolved, or that already was
+ */
+static int grn_future_wait(grn_future **futures, int count, bool all) {
+  grn_preempt_disable();
+
+  grn_future_waiter waiter = {.thread = STATE.current, .remaining = 0, .first = -1};
+
+  for (int i = 0; i < count; i++) {
+    if (!futures[i]->resolved) {
+      waiter.remaining++;
+    } else if (waiter.first == -1) {
+      waiter.first = i;
+    }
+  }
+
+  if (waiter.remaining == 0 || (!all && waiter.first != -1)) {
+    grn_preempt_enable();
+    return waiter.first;
+  }
+
+  if (!all) waiter.remaining = 1;
+
+  grn_future_link single;
+  grn_future_link *links = count == 1 ? &single : malloc(count * sizeof(grn_future_link));
+  assert_malloc(links);
+
+  for (int i = 0; i < count; i++) {
+    grn_future *future = futures[i];
+    links[i].future = NULL;
+    if (future->resolved) continue;
+
+    links[i].waiter = &waiter;
+    links[i].future = future;
+    links[i].index = i;
+    links[i].prev = NULL;
+    links[i].next = future->links;
+    if (future->links != NULL) future->links->prev = &links[i];
+    future->links = &links[i];
+  }
+
+  while (waiter.remaining > 0) {
+    STATE.current->status = WAITING;
+    grn_yield();
+  }
+
+  // Futures that haven't resolved, after grn_await_any(), still link to us
+  for (int i = 0; i < count; i++) {
+    grn_future *future = links[i].future;
+    if (future == NULL) continue;
+
+    if (links[i].prev != NULL) {
+      links[i].prev->next = links[i].next;
+    } else {
+      future->links = links[i].next;
+    }
+    if (links[i].next != NULL) links[i].next->prev = links[i].prev;
+  }
+
+  if (links != &single) free(links);
+
+  grn_preempt_enable();
+  return waiter.first;
+}
+
+/**
+ * Parks the current thread until `future` resolves. Any number of threads can
+ * await the same future.
+ *
+ * @return the value `future` resolved to
+ */
+void *grn_await(grn_future *future) {
+  grn_future_wait(&future, 1, true);
+  return future->value;
+}
+
+/**
+ * Parks the current thread until one of `futures` resolves.
+ *
+ * @param futures the futures to wait on
+ * @param count the number of futures, at least 1
+ *
+ * @return the index of a resolved future, the first to resolve if none had
+ *         when this was called
+ */
+int grn_await_any(grn_future **futures, int count) {
+  return grn_future_wait(futures, count, false);
+}
+
+/**
+ * Parks the current thread until all of `futures` have resolved. The thread
+ * is woken once, by the last one, however many there are. Their values can
+ * then be read with grn_await(), which returns right away.
+ *
+ * @param futures the futures to wait on
+ * @param count the number of futures
+ */
+void grn_await_all(grn_future **futures, int count) {
+  grn_future_wait(futures, count, true);
+}
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chloros.h"
+#include "group.h"
+#include "main.h"
+#include "thread.h"
+#include "timer.h"
+#include "utils.h"
+
+/*
+ * Groups take effect when threads are switched: grn_yield() charges the
+ * outgoing thread's CPU time to its group (see grn_rq_charge()), which is
+ * where a group that has used up its quota gets throttled. The run queues then
+ * hold its threads back on the group's `held` list instead of queueing them,
+ * until a timer refills the quota at the end of the period. Without
+ * preemption a thread can only overrun its quota until it next yields.
+ */
+
+/**
+ * Ends a throttled period: the group gets a fresh quota and its held threads
+ * are queued again. Runs from grn_timer_fire() with preemption disabled.
+ */
+static void grn_group_refill(void *arg) {
+  grn_group *group = arg;
+  uint64_t now = grn_now();
+
+  group->throttled = false;
+  group->throttled_time += now - group->throttled_since;
+  group->period_start = now;
+  group->period_used = 0;
+
+  // The held list is newest first, queue them oldest first
+  grn_thread *held = group->held;
+  group->held = NULL;
+  while (held != NULL && held->rq_next != NULL) held = held->rq_next;
+
+  while (held != NULL) {
+    grn_thread *prev = held->rq_prev;
+    held->rq_held = false;
+    held->in_rq = false;
+    grn_rq_enqueue(held, false);
+    held = prev;
+  }
+}
+
+/**
+ * Creates a group of threads sharing a CPU allowance.
+ *
+ * Under grn_policy_fair, groups split the CPU in proportion to their shares, a
+ * thread outside any group counting as a group of its own with
+ * GRN_GROUP_SHARES_DEFAULT shares. Within a group the threads split its share
+ * by their priorities. With a quota (see grn_group_set_quota()) the group is
+ * limited to a fixed amount of CPU time per period under any policy.
+ *
+ * @param shares the group's relative weight, GRN_GROUP_SHARES_DEFAULT for the
+ *               same as a thread outside any group
+ *
+ * @return the new group, or NULL with errno set to EINVAL if `shares` is 0
+ */
+grn_group *grn_group_create(uint32_t shares) {
+  if (shares == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  grn_group *group = calloc(1, sizeof(grn_group));
+  assert_malloc(group);
+
+  group->shares = shares;
+  group->refill.on_fire = grn_group_refill;
+  group->refill.on_fire_arg = group;
+
+  return group;
+}
+
+/**
+ * Limits the threads of `group` to `quota_us` microseconds of CPU time every
+ * `period_us` microseconds. Once the quota is used up, the group's threads
+ * don't run again until the period is over.
+ *
+ * @param group the group to limit
+ * @param quota_us CPU time allowed per period, 0 removes the limit
+ * @param period_us the length of a period
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if a quota is given
+ *         without a period
+ */
+int grn_group_set_quota(grn_group *group, uint64_t quota_us, uint64_t period_us) {
+  if (quota_us > 0 && period_us == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  grn_preempt_disable();
+
+  group->quota = quota_us * 1000;
+  group->period = period_us * 1000;
+  group->period_start = grn_now();
+  group->period_used = 0;
+
+  if (group->throttled) {
+    grn_timer_remove(&group->refill);
+    grn_group_refill(group);
+  }
+
+  grn_preempt_enable();
+  return 0;
+}
+
+/**
+ * Frees `group`. Groups can only be destroyed once all their threads have
+ * exited.
+ *
+ * @return 0 on success, -1 with errno set to EBUSY if the group still has
+ *         threads
+ */
+int grn_group_destroy(grn_group *group) {
+  grn_preempt_disable();
+
+  if (group->threads > 0) {
+    grn_preempt_enable();
+    errno = EBUSY;
+    return -1;
+  }
+
+  grn_timer_remove(&group->refill);
+  free(group);
+
+  grn_preempt_enable();
+  return 0;
+}
+
+/**
+ * Copies the usage counters of `group` into `stats`. Time is in nanoseconds
+ * and only counts up to the last time one of the group's threads was switched
+ * out.
+ */
+void grn_group_get_stats(const grn_group *group, grn_group_stats *stats) {
+  grn_preempt_disable();
+
+  stats->runtime = group->runtime;
+  stats->throttled_time = group->throttled_time;
+  stats->throttle_count = group->throttle_count;
+  stats->threads = group->threads;
+  stats->throttled = group->throttled;
+
+  grn_preempt_enable();
+}
+
+/**
+ * Charges `delta` nanoseconds of CPU time, ending at `now`, to `group`, and
+ * throttles it if that uses up its quota for the period.
+ */
+void grn_group_charge(grn_group *group, uint64_t delta, uint64_t now) {
+  group->runtime += delta;
+
+  if (group->quota == 0 || group->throttled) return;
+
+  // Unused quota doesn't carry over
+  if (now - group->period_start >= group->period) {
+    group->period_start = now;
+    group->period_used = 0;
+  }
+
+  group->period_used += delta;
+  if (group->period_used < group->quota) return;
+
+  group->throttled = true;
+  group->throttled_since = now;
+  group->throttle_count++;
+  grn_timer_add(&group->refill, group->period_start + group->period);
+}
+
+/**
+ * Holds a thread that's being queued back if its group is throttled.
+ *
+ * @return true if `thread` is now on its group's held list, false if it should
+ *         go in the run queues
+ */
+bool grn_group_hold(grn_thread *thread) {
+  grn_group *group = thread->group;
+  if (group == NULL || !group->throttled) return false;
+
+  thread->rq_prev = NULL;
+  thread->rq_next = group->held;
+  if (group->held) group->held->rq_prev = thread;
+  group->held = thread;
+
+  thread->rq_held = true;
+  thread->in_rq = true;
+  return true;
+}
+
+/**
+ * Takes a held thread off its group's held list.
+ *
+ * @return true if `thread` was held, false otherwise
+ */
+bool grn_group_release(grn_thread *thread) {
+  if (!thread->rq_held) return false;
+
+  if (thread->rq_prev) {
+    thread->rq_prev->rq_next = thread->rq_next;
+  } else {
+    thread->group->held = thread->rq_next;
+  }
+  if (thread->rq_next) thread->rq_next->rq_prev = thread->rq_prev;
+
+  thread->rq_held = false;
+  return true;
+}
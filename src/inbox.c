@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "inbox.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * Other kernel threads hand work to a scheduler through two lock-free stacks
+ * in its STATE, one of spawn requests and one of wakers to wake. Any
+ * number of threads push with a compare-and-swap, the scheduler takes a whole
+ * stack at once with an exchange. A push onto an empty stack writes to an
+ * eventfd in the epoll set, so a scheduler blocked in epoll_wait() wakes up
+ * and a burst of pushes costs a single wakeup.
+ */
+
+#define GRN_WAKER_EMPTY 0
+#define GRN_WAKER_PARKED 1
+#define GRN_WAKER_NOTIFIED 2
+
+/*
+ * Pushes `node` onto the stack headed by `*head_ptr`, setting `was_empty` if
+ * it's the first entry since the scheduler last drained it.
+ */
+#define GRN_INBOX_PUSH(head_ptr, node, was_empty)                                       \
+  do {                                                                                  \
+    __typeof__(node) head_ = __atomic_load_n(head_ptr, __ATOMIC_RELAXED);               \
+    do {                                                                                \
+      (node)->next = head_;                                                             \
+    } while (!__atomic_compare_exchange_n(head_ptr, &head_, node, true, __ATOMIC_RELEASE, \
+                                          __ATOMIC_RELAXED));                           \
+    was_empty = head_ == NULL;                                                          \
+  } while (0)
+
+/**
+ * Creates the inbox's eventfd and adds it to the epoll set. Called by
+ * grn_init().
+ */
+void grn_inbox_init() {
+  STATE.inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (STATE.inbox_fd == -1) {
+    fprintf(stderr, "WARNING: Could not create the inbox eventfd\n");
+    return;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = STATE.inbox_fd};
+  if (epoll_ctl(STATE.epfd, EPOLL_CTL_ADD, STATE.inbox_fd, &event) == -1) {
+    fprintf(stderr, "WARNING: Could not watch the inbox eventfd\n");
+  }
+}
+
+/**
+ * Wakes up the scheduler of `state` if it's blocked in epoll_wait().
+ */
+static void grn_inbox_kick(chloros_state *state) {
+  uint64_t one = 1;
+  while (grn_sys_write(state->inbox_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+}
+
+/**
+ * Wakes the thread parked on `waker`. Must run on the scheduler's kernel
+ * thread with preemption disabled.
+ */
+static void grn_waker_deliver(grn_waker *waker) {
+  grn_thread *thread = waker->thread;
+  waker->thread = NULL;
+  grn_wake_thread(thread);
+}
+
+/**
+ * Handles an epoll event on `fd` if it's the inbox's eventfd: starts the
+ * requested threads, in the order they were requested, and wakes the parked
+ * ones. Called by the scheduler with preemption disabled.
+ *
+ * @return true if the event was the inbox's, false otherwise
+ */
+bool grn_inbox_event(int fd) {
+  if (fd == -1 || fd != STATE.inbox_fd) return false;
+
+  uint64_t count;
+  while (grn_sys_read(STATE.inbox_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+    ;
+
+  // The stack is newest first
+  grn_inbox_spawn *spawns = __atomic_exchange_n(&STATE.inbox_spawns, NULL, __ATOMIC_ACQUIRE);
+  grn_inbox_spawn *in_order = NULL;
+  while (spawns != NULL) {
+    grn_inbox_spawn *next = spawns->next;
+    spawns->next = in_order;
+    in_order = spawns;
+    spawns = next;
+  }
+
+  while (in_order != NULL) {
+    grn_inbox_spawn *next = in_order->next;
+
+    grn_thread *thread = grn_create(in_order->fn, in_order->arg, GRN_PRIO_DEFAULT, NULL);
+    thread->detached = true;
+    free(in_order);
+
+    in_order = next;
+  }
+
+  grn_waker *wakes = __atomic_exchange_n(&STATE.inbox_wakes, NULL, __ATOMIC_ACQUIRE);
+  while (wakes != NULL) {
+    grn_waker *next = wakes->next;
+    grn_waker_deliver(wakes);
+    wakes = next;
+  }
+
+  return true;
+}
+
+/**
+ * Has the scheduler of `state` start a detached green thread running
+ * `fn(arg)`. Safe to call from any kernel thread.
+ *
+ * @return 0 on success, -1 with errno set to ENOSYS if the scheduler has no
+ *         inbox
+ */
+int grn_inbox_spawn_on(chloros_state *state, grn_fn fn, void *arg) {
+  if (state == NULL || state->inbox_fd == -1) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  grn_inbox_spawn *request = malloc(sizeof(grn_inbox_spawn));
+  assert_malloc(request);
+  request->fn = fn;
+  request->arg = arg;
+
+  bool was_empty;
+  GRN_INBOX_PUSH(&state->inbox_spawns, request, was_empty);
+  if (was_empty) grn_inbox_kick(state);
+
+  return 0;
+}
+
+/**
+ * Starts a detached green thread running `fn(arg)` from any kernel thread.
+ * The thread is created the next time the scheduler checks for events, and
+ * its return value is discarded. It goes to the scheduler grn_init() last
+ * started outside of a shard, use grn_shard_submit() to pick a shard.
+ *
+ * @return 0 on success, -1 if grn_init() couldn't set up the inbox
+ */
+int grn_spawn_external(grn_fn fn, void *arg) {
+  return grn_inbox_spawn_on(__atomic_load_n(&grn_home_state, __ATOMIC_ACQUIRE), fn, arg);
+}
+
+/**
+ * Initializes `waker` with no pending wake. A zeroed grn_waker is
+ * initialized too.
+ */
+void grn_waker_init(grn_waker *waker) {
+  waker->state = GRN_WAKER_EMPTY;
+  waker->thread = NULL;
+  waker->owner = NULL;
+  waker->next = NULL;
+}
+
+/**
+ * Parks the current green thread until grn_wake() is called on `waker`,
+ * or returns right away if it was called since the last grn_park(). Only one
+ * thread may park on a waker at a time.
+ *
+ * @param waker the waker to wait on
+ */
+void grn_park(grn_waker *waker) {
+  grn_preempt_disable();
+
+  waker->thread = STATE.current;
+  waker->owner = &STATE;
+
+  int expected = GRN_WAKER_EMPTY;
+  if (__atomic_compare_exchange_n(&waker->state, &expected, GRN_WAKER_PARKED, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    // The waker clears `thread` once the wake is delivered, other wakeups are
+    // spurious
+    while (waker->thread != NULL) {
+      STATE.current->status = WAITING;
+      grn_yield();
+    }
+  } else {
+    waker->thread = NULL;
+  }
+
+  __atomic_store_n(&waker->state, GRN_WAKER_EMPTY, __ATOMIC_RELEASE);
+
+  grn_preempt_enable();
+}
+
+/**
+ * Wakes the green thread parked on `waker`, or makes its next grn_park()
+ * return right away. Wakes that arrive before the thread gets to run again
+ * count as one. Safe to call from any kernel thread, including from a green
+ * thread of another shard.
+ *
+ * @param waker the waker to notify
+ */
+void grn_wake(grn_waker *waker) {
+  int old = __atomic_exchange_n(&waker->state, GRN_WAKER_NOTIFIED, __ATOMIC_ACQ_REL);
+  if (old != GRN_WAKER_PARKED) return;
+
+  // The waker may be gone as soon as it's pushed
+  chloros_state *owner = waker->owner;
+
+  if (grn_scheduler_thread && owner == &STATE) {
+    grn_preempt_disable();
+    grn_waker_deliver(waker);
+    grn_preempt_enable();
+    return;
+  }
+
+  bool was_empty;
+  GRN_INBOX_PUSH(&owner->inbox_wakes, waker, was_empty);
+  if (was_empty) grn_inbox_kick(owner);
+}
@@ -0,0 +1,774 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "io.h"
+#include "main.h"
+#include "probes.h"
+#include "thread.h"
+#include "timer.h"
+#include "utils.h"
+
+#undef malloc
+#undef calloc
+#undef free
+
+/**
+ * Returns the record for `fd`, creating it (and growing the table) if needed.
+ * Must be called with preemption disabled.
+ *
+ * @param fd a non-negative file descriptor
+ *
+ * @return the record for `fd`
+ */
+static grn_fd_record *grn_fd_get(int fd) {
+  if (fd >= STATE.fd_records_size) {
+    int new_size = STATE.fd_records_size ? STATE.fd_records_size : 64;
+    while (new_size <= fd) new_size *= 2;
+
+    STATE.fd_records = realloc(STATE.fd_records, new_size * sizeof(grn_fd_record *));
+    assert_malloc(STATE.fd_records);
+    memset(&STATE.fd_records[STATE.fd_records_size], 0,
+           (new_size - STATE.fd_records_size) * sizeof(grn_fd_record *));
+    STATE.fd_records_size = new_size;
+  }
+
+  grn_fd_record *record = STATE.fd_records[fd];
+  if (record == NULL) {
+    record = calloc(1, sizeof(grn_fd_record));
+    assert_malloc(record);
+    record->fd = fd;
+    record->pollable = true;
+    STATE.fd_records[fd] = record;
+  }
+
+  return record;
+}
+
+/**
+ * Arms the epoll registration of `record` for every direction that has
+ * waiters. The registration is one-shot, so it has to be re-armed after every
+ * event that still leaves someone waiting.
+ *
+ * @return 0 on success, -1 with errno set if epoll won't watch the fd
+ */
+static int grn_fd_arm(grn_fd_record *record) {
+  struct epoll_event event;
+  event.events = EPOLLONESHOT;
+  event.data.fd = record->fd;
+
+  if (record->readers.head) event.events |= EPOLLIN;
+  if (record->writers.head) event.events |= EPOLLOUT;
+
+  // A registered fd that was closed and reopened is no longer in the epoll
+  // set, and an fd we haven't seen may still be from a dup()ed description
+  int op = record->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  // Fails with ENOTSOCK for pipes and the like, they're waited on as usual
+  if (!record->registered && STATE.busy_poll_us > 0) {
+    int us = (int)STATE.busy_poll_us;
+    setsockopt(record->fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+  }
+
+  int err = epoll_ctl(STATE.epfd, op, record->fd, &event);
+
+  if (err == -1 && errno == ENOENT) {
+    err = epoll_ctl(STATE.epfd, EPOLL_CTL_ADD, record->fd, &event);
+  } else if (err == -1 && errno == EEXIST) {
+    err = epoll_ctl(STATE.epfd, EPOLL_CTL_MOD, record->fd, &event);
+  }
+
+  if (err == -1) {
+    struct stat st;
+    if (errno == EPERM && fstat(record->fd, &st) == 0) {
+      record->pollable = false;
+      record->dev = st.st_dev;
+      record->ino = st.st_ino;
+      record->disk = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+    }
+    return -1;
+  }
+
+  record->registered = true;
+  return 0;
+}
+
+/**
+ * Forgets what was learned about the fd `record` was for, once the number
+ * refers to something else.
+ */
+static void grn_fd_reset(grn_fd_record *record) {
+  record->registered = false;
+  record->pollable = true;
+}
+
+/**
+ * Returns false if epoll refused the fd and it's still the same file. An fd
+ * closed with plain close() leaves its record behind, and the number may have
+ * been reused for a socket or a pipe since, in which case the record starts
+ * over.
+ */
+static bool grn_fd_check_pollable(grn_fd_record *record) {
+  if (record->pollable) return true;
+
+  struct stat st;
+  if (fstat(record->fd, &st) == 0 && st.st_dev == record->dev && st.st_ino == record->ino) {
+    return false;
+  }
+
+  grn_fd_reset(record);
+  return true;
+}
+
+/**
+ * Queues `waiter` on the side of `record` matching its events and arms the
+ * record.
+ *
+ * @return 0 on success, -1 if the fd can't be waited on
+ */
+static int grn_fd_enqueue(grn_fd_record *record, grn_waiter *waiter) {
+  if (!grn_fd_check_pollable(record)) return -1;
+
+  waiter->thread = STATE.current;
+  grn_waitq_push((waiter->events & EPOLLIN) ? &record->readers : &record->writers, waiter);
+
+  if (grn_fd_arm(record) == -1) {
+    grn_waitq_remove(waiter);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Parks the current thread until `fd` is ready for `events` (EPOLLIN or
+ * EPOLLOUT).
+ *
+ * @param fd the file descriptor to wait on
+ * @param events EPOLLIN to wait for the fd to be readable, EPOLLOUT for writable
+ *
+ * @return 0 once the fd is ready, -1 if the fd can't be waited on, e.g. a
+ * regular file or a closed fd, in which case the caller should just go ahead
+ * with the call, GRN_FD_CLOSED (with errno set to EBADF) if the fd was closed
+ * with grn_close() while the thread was parked, in which case the caller must
+ * not make the call: the number may already belong to another file
+ */
+int grn_fd_wait(int fd, uint32_t events) {
+  if (fd < 0) return -1;
+
+  grn_preempt_disable();
+
+  grn_fd_record *record = grn_fd_get(fd);
+  uint32_t generation = record->generation;
+
+  grn_waiter waiter = {.events = events};
+  if (grn_fd_enqueue(record, &waiter) == -1) {
+    grn_preempt_enable();
+    return -1;
+  }
+
+  STATE.current->status = WAITING;
+  GRN_PROBE3(io_park, STATE.current->id, fd, events);
+  grn_yield();
+  GRN_PROBE2(io_unpark, STATE.current->id, fd);
+
+  // Still queued if something other than the fd woke us up
+  grn_waitq_remove(&waiter);
+
+  bool closed = record->generation != generation;
+
+  grn_preempt_enable();
+
+  if (closed) {
+    errno = EBADF;
+    return GRN_FD_CLOSED;
+  }
+
+  return 0;
+}
+
+/**
+ * Handles an epoll event for `fd`. Wakes the first reader if the fd became
+ * readable and the first writer if it became writable, then re-arms the fd
+ * for whoever is left waiting. Errors and hangups wake both sides so they can
+ * see the failure from their call.
+ *
+ * @param fd the file descriptor the event is for
+ * @param revents the events epoll reported
+ */
+void grn_fd_ready(int fd, uint32_t revents) {
+  if (fd < 0 || fd >= STATE.fd_records_size || STATE.fd_records[fd] == NULL) return;
+
+  grn_fd_record *record = STATE.fd_records[fd];
+
+  if (revents & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+    grn_waiter *waiter = grn_waitq_wake_one(&record->readers, revents);
+    if (waiter) GRN_PROBE2(epoll_wake, waiter->thread->id, revents);
+  }
+
+  if (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+    grn_waiter *waiter = grn_waitq_wake_one(&record->writers, revents);
+    if (waiter) GRN_PROBE2(epoll_wake, waiter->thread->id, revents);
+  }
+
+  if (record->readers.head || record->writers.head) {
+    grn_fd_arm(record);
+  }
+}
+
+/**
+ * close() for fds used with the grn_* wrappers. Drops what the scheduler knew
+ * about `fd`, so nothing carries over to the next fd with its number, and
+ * wakes the threads still parked on it, whose calls then fail with EBADF.
+ *
+ * @return the result of close()
+ */
+int grn_close(int fd) {
+  if (fd < 0) return grn_sys_close(fd);
+
+  grn_preempt_disable();
+
+  grn_fd_record *record = fd < STATE.fd_records_size ? STATE.fd_records[fd] : NULL;
+
+  // A dup()ed description stays in the epoll set after close()
+  if (record != NULL && record->registered) epoll_ctl(STATE.epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  int ret = grn_sys_close(fd);
+
+  if (record != NULL) {
+    while (grn_waitq_wake_one(&record->readers, EPOLLHUP)) continue;
+    while (grn_waitq_wake_one(&record->writers, EPOLLHUP)) continue;
+    record->generation++;
+    grn_fd_reset(record);
+  }
+
+  grn_preempt_enable();
+  return ret;
+}
+
+/**
+ * Sets how many grn_* I/O calls a thread may complete without parking before
+ * it is made to yield. Without preemption, a thread on a connection that always
+ * has data ready would otherwise never give up the CPU. The budget is refilled
+ * whenever the thread is scheduled. 0 disables the budget.
+ *
+ * @param budget the number of calls, COOP_BUDGET by default
+ */
+void grn_set_coop_budget(uint32_t budget) {
+  STATE.coop_budget = budget;
+  STATE.current->budget = budget;
+}
+
+/**
+ * Charges the current thread for an I/O call that completed without parking,
+ * yielding once its budget runs out.
+ */
+static void grn_coop_charge() {
+  if (STATE.coop_budget == 0) return;
+
+  if (STATE.current->budget <= 1) {
+    grn_yield();
+  } else {
+    STATE.current->budget--;
+  }
+}
+
+/**
+ * Returns true if `fd` is in nonblocking mode, in which case the wrappers try
+ * the call before parking since the fd is usually already ready. The mode is
+ * read on every call rather than cached: a stale "nonblocking" for an fd
+ * number that was close()d and reused, or whose flag was cleared with fcntl(),
+ * would make the wrapper block the scheduler in the call.
+ */
+static bool grn_fd_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && (flags & O_NONBLOCK);
+}
+
+/**
+ * Returns true if a call on a nonblocking fd completed, i.e. it didn't fail
+ * because the fd wasn't ready.
+ */
+static bool grn_io_completed(ssize_t ret) {
+  return ret != -1 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/*
+ * Runs `call`, which must assign its result to `ret`, without blocking the
+ * scheduler. If `nonblocking` (the call can't block, e.g. the fd is in
+ * nonblocking mode) the call is tried first and the thread only parks when it
+ * fails with EAGAIN, retrying until it completes. Otherwise the thread parks
+ * until the fd is ready and then makes the call once. If the fd is closed with
+ * grn_close() while the thread is parked, `ret` is set to -1 with errno EBADF
+ * and the call isn't made.
+ */
+#define GRN_IO(ret, fd, events, nonblocking, call)    \
+  do {                                                \
+    bool nonblocking_ = (nonblocking);                \
+    if (nonblocking_) {                               \
+      call;                                           \
+      if (grn_io_completed(ret)) {                    \
+        grn_coop_charge();                            \
+        break;                                        \
+      }                                               \
+    }                                                 \
+    for (;;) {                                        \
+      if (grn_fd_wait(fd, events) == GRN_FD_CLOSED) { \
+        ret = -1;                                     \
+        break;                                        \
+      }                                               \
+      call;                                           \
+      if (!nonblocking_ || grn_io_completed(ret)) {   \
+        break;                                        \
+      }                                               \
+    }                                                 \
+  } while (0)
+
+/**
+ * Returns true if calls on `fd` should run on the offload pool: epoll won't
+ * watch it and it's a regular file or a block device. The first call for an
+ * fd registers it (with no events armed) to find out. Sockets, pipes and FIFOs
+ * never are, a worker blocked on one could wait forever for a green thread
+ * that can't run until the worker is free.
+ */
+static bool grn_fd_offloaded(int fd) {
+  if (fd < 0) return false;
+
+  grn_preempt_disable();
+
+  grn_fd_record *record = grn_fd_get(fd);
+  if (grn_fd_check_pollable(record) && !record->registered) {
+    grn_fd_arm(record);
+  }
+  bool offloaded = !record->pollable && record->disk;
+
+  grn_preempt_enable();
+  return offloaded;
+}
+
+/*
+ * A read() or write() on a file epoll can't tell us about, run on the offload
+ * pool instead. Disks are always "ready" but still block.
+ */
+typedef struct grn_file_io_struct {
+  int fd;
+  void *buf;
+  size_t count;
+  bool write;
+} grn_file_io;
+
+static void *grn_file_io_call(void *arg) {
+  grn_file_io *io = arg;
+  ssize_t ret = io->write ? grn_sys_write(io->fd, io->buf, io->count)
+                          : grn_sys_read(io->fd, io->buf, io->count);
+  return (void *)(intptr_t)ret;
+}
+
+// read()/write() syscall wrappers
+
+ssize_t grn_read(int fd, void *buf, size_t count) {
+  if (grn_fd_offloaded(fd)) {
+    grn_file_io io = {fd, buf, count, false};
+    return (ssize_t)(intptr_t)grn_offload(grn_file_io_call, &io);
+  }
+
+  ssize_t bytes_read;
+  GRN_IO(bytes_read, fd, EPOLLIN, grn_fd_nonblocking(fd), bytes_read = grn_sys_read(fd, buf, count));
+  return bytes_read;
+}
+
+ssize_t grn_write(int fd, const void *buf, size_t count) {
+  if (grn_fd_offloaded(fd)) {
+    grn_file_io io = {fd, (void *)buf, count, true};
+    return (ssize_t)(intptr_t)grn_offload(grn_file_io_call, &io);
+  }
+
+  ssize_t bytes_written;
+  GRN_IO(bytes_written, fd, EPOLLOUT, grn_fd_nonblocking(fd),
+         bytes_written = grn_sys_write(fd, buf, count));
+  return bytes_written;
+}
+
+// readv()/writev() wrappers
+
+ssize_t grn_readv(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_read;
+  GRN_IO(bytes_read, fd, EPOLLIN, grn_fd_nonblocking(fd), bytes_read = readv(fd, iov, iovcnt));
+  return bytes_read;
+}
+
+ssize_t grn_writev(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_written;
+  GRN_IO(bytes_written, fd, EPOLLOUT, grn_fd_nonblocking(fd),
+         bytes_written = writev(fd, iov, iovcnt));
+  return bytes_written;
+}
+
+// recvmsg()/sendmsg() wrappers
+//
+// MSG_DONTWAIT makes the call nonblocking whatever mode the socket is in, so
+// these always try the call first. Callers passing MSG_DONTWAIT themselves
+// want EAGAIN rather than a wait, and get the plain call.
+
+ssize_t grn_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+  if (flags & MSG_DONTWAIT) return recvmsg(sockfd, msg, flags);
+
+  ssize_t bytes_read;
+  GRN_IO(bytes_read, sockfd, EPOLLIN, true,
+         bytes_read = recvmsg(sockfd, msg, flags | MSG_DONTWAIT));
+  return bytes_read;
+}
+
+ssize_t grn_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+  if (flags & MSG_DONTWAIT) return sendmsg(sockfd, msg, flags);
+
+  ssize_t bytes_written;
+  GRN_IO(bytes_written, sockfd, EPOLLOUT, true,
+         bytes_written = sendmsg(sockfd, msg, flags | MSG_DONTWAIT));
+  return bytes_written;
+}
+
+// Datagram wrappers, same MSG_DONTWAIT convention as recvmsg()/sendmsg()
+
+ssize_t grn_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                     socklen_t *addrlen) {
+  if (flags & MSG_DONTWAIT) return recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+
+  ssize_t bytes_read;
+  GRN_IO(bytes_read, sockfd, EPOLLIN, true,
+         bytes_read = recvfrom(sockfd, buf, len, flags | MSG_DONTWAIT, src_addr, addrlen));
+  return bytes_read;
+}
+
+ssize_t grn_sendto(int sockfd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *dest_addr, socklen_t addrlen) {
+  if (flags & MSG_DONTWAIT) return sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+
+  ssize_t bytes_written;
+  GRN_IO(bytes_written, sockfd, EPOLLOUT, true,
+         bytes_written = sendto(sockfd, buf, len, flags | MSG_DONTWAIT, dest_addr, addrlen));
+  return bytes_written;
+}
+
+/**
+ * recvmmsg() for green threads. Parks until at least one datagram is queued,
+ * then receives as many of the queued datagrams as fit in `msgvec` in one
+ * syscall, without waiting for the rest of `vlen` to arrive.
+ *
+ * recvmmsg()'s timeout argument is left out, use grn_poll() to bound the wait.
+ *
+ * @return the number of datagrams received, or -1 on error
+ */
+int grn_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+  if (flags & MSG_DONTWAIT) return recvmmsg(sockfd, msgvec, vlen, flags, NULL);
+
+  int msgs_read;
+  GRN_IO(msgs_read, sockfd, EPOLLIN, true,
+         msgs_read = recvmmsg(sockfd, msgvec, vlen, flags | MSG_DONTWAIT, NULL));
+  return msgs_read;
+}
+
+/**
+ * sendmmsg() for green threads. Parks until the socket is writable, then
+ * sends as many of the `vlen` datagrams as the socket takes in one syscall.
+ *
+ * @return the number of datagrams sent, which may be less than `vlen`, or -1
+ *         on error
+ */
+int grn_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+  if (flags & MSG_DONTWAIT) return sendmmsg(sockfd, msgvec, vlen, flags);
+
+  int msgs_written;
+  GRN_IO(msgs_written, sockfd, EPOLLOUT, true,
+         msgs_written = sendmmsg(sockfd, msgvec, vlen, flags | MSG_DONTWAIT));
+  return msgs_written;
+}
+
+// Zero-copy wrappers
+
+ssize_t grn_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  ssize_t bytes_sent;
+  GRN_IO(bytes_sent, out_fd, EPOLLOUT, grn_fd_nonblocking(out_fd),
+         bytes_sent = sendfile(out_fd, in_fd, offset, count));
+  return bytes_sent;
+}
+
+/**
+ * Parks the current thread until `fd_in` is readable and `fd_out` writable,
+ * which is what splice() and tee() need to make progress.
+ *
+ * @return GRN_FD_CLOSED if either fd was closed with grn_close() meanwhile, as
+ * for grn_fd_wait(), 0 otherwise
+ */
+static int grn_fd_wait_pair(int fd_in, int fd_out) {
+  for (;;) {
+    struct pollfd fds[2] = {{.fd = fd_in, .events = POLLIN}, {.fd = fd_out, .events = POLLOUT}};
+    if (grn_sys_poll(fds, 2, 0) == -1) return 0;
+
+    int waited;
+    if (!fds[0].revents) {
+      waited = grn_fd_wait(fd_in, EPOLLIN);
+    } else if (!fds[1].revents) {
+      waited = grn_fd_wait(fd_out, EPOLLOUT);
+    } else {
+      return 0;
+    }
+
+    if (waited == GRN_FD_CLOSED) return GRN_FD_CLOSED;
+    if (waited == -1) return 0;
+  }
+}
+
+/*
+ * Like GRN_IO, but for calls that move data from `fd_in` to `fd_out` and so
+ * need both of them to be ready. The calls are always made with
+ * SPLICE_F_NONBLOCK, so they're tried first and retried after EAGAIN whatever
+ * the fds' own mode.
+ */
+#define GRN_IO_PAIR(ret, fd_in, fd_out, call)                 \
+  do {                                                        \
+    call;                                                     \
+    if (grn_io_completed(ret)) {                              \
+      grn_coop_charge();                                      \
+      break;                                                  \
+    }                                                         \
+    for (;;) {                                                \
+      if (grn_fd_wait_pair(fd_in, fd_out) == GRN_FD_CLOSED) { \
+        ret = -1;                                             \
+        break;                                                \
+      }                                                       \
+      call;                                                   \
+      if (grn_io_completed(ret)) break;                       \
+    }                                                         \
+  } while (0)
+
+ssize_t grn_splice(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len,
+                   unsigned int flags) {
+  ssize_t bytes_moved;
+  GRN_IO_PAIR(bytes_moved, fd_in, fd_out,
+              bytes_moved = splice(fd_in, (loff_t *)off_in, fd_out, (loff_t *)off_out, len,
+                                   flags | SPLICE_F_NONBLOCK));
+  return bytes_moved;
+}
+
+ssize_t grn_tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+  ssize_t bytes_copied;
+  GRN_IO_PAIR(bytes_copied, fd_in, fd_out,
+              bytes_copied = tee(fd_in, fd_out, len, flags | SPLICE_F_NONBLOCK));
+  return bytes_copied;
+}
+
+/**
+ * Gets an empty, nonblocking pipe from the pool, creating one if the pool is
+ * empty. Give it back with grn_pipe_release().
+ *
+ * @param[out] pipefd set to the read and write ends of the pipe
+ *
+ * @return 0 on success, -1 if a pipe couldn't be created
+ */
+int grn_pipe_acquire(int pipefd[2]) {
+  grn_preempt_disable();
+
+  if (STATE.pipe_pool_count > 0) {
+    STATE.pipe_pool_count--;
+    pipefd[0] = STATE.pipe_pool[STATE.pipe_pool_count][0];
+    pipefd[1] = STATE.pipe_pool[STATE.pipe_pool_count][1];
+    grn_preempt_enable();
+    return 0;
+  }
+
+  grn_preempt_enable();
+  return pipe2(pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+/**
+ * Returns a pipe from grn_pipe_acquire() to the pool. Pipes that still hold
+ * data, or that don't fit in the pool, are closed instead.
+ *
+ * @param pipefd the read and write ends of the pipe
+ */
+void grn_pipe_release(int pipefd[2]) {
+  int pending = 0;
+  ioctl(pipefd[0], FIONREAD, &pending);
+
+  grn_preempt_disable();
+
+  if (pending == 0 && STATE.pipe_pool_count < PIPE_POOL_SIZE) {
+    STATE.pipe_pool[STATE.pipe_pool_count][0] = pipefd[0];
+    STATE.pipe_pool[STATE.pipe_pool_count][1] = pipefd[1];
+    STATE.pipe_pool_count++;
+  } else {
+    grn_sys_close(pipefd[0]);
+    grn_sys_close(pipefd[1]);
+  }
+
+  grn_preempt_enable();
+}
+
+/**
+ * Moves up to `len` bytes from `fd_in` to `fd_out` without copying them
+ * through user space, splicing through a pipe from the pool. Useful for
+ * relaying between two sockets.
+ *
+ * @return the number of bytes moved, 0 at end of input, -1 on error. If writing
+ * to `fd_out` fails after some of the bytes made it, the bytes written so far
+ * are returned and the ones still in the pipe are lost.
+ */
+ssize_t grn_splice_copy(int fd_in, int fd_out, size_t len) {
+  int pipefd[2];
+  if (grn_pipe_acquire(pipefd) == -1) return -1;
+
+  ssize_t bytes_in = grn_splice(fd_in, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE);
+
+  ssize_t bytes_out = 0;
+  while (bytes_in > 0 && bytes_out < bytes_in) {
+    ssize_t moved = grn_splice(pipefd[0], NULL, fd_out, NULL, bytes_in - bytes_out,
+                               SPLICE_F_MOVE);
+    if (moved <= 0) {
+      // Whatever is left in the pipe is lost with it. splice() only returns 0
+      // with nothing to move, which can't be with bytes in the pipe.
+      int saved_errno = moved == 0 ? EIO : errno;
+      grn_sys_close(pipefd[0]);
+      grn_sys_close(pipefd[1]);
+      if (bytes_out > 0) return bytes_out;
+      errno = saved_errno;
+      return -1;
+    }
+    bytes_out += moved;
+  }
+
+  grn_pipe_release(pipefd);
+  return bytes_in;
+}
+
+// accept() wrapper
+int grn_accept(int sockfd, struct sockaddr *restrict addr, socklen_t *restrict addrlen) {
+  int accept_return;
+  GRN_IO(accept_return, sockfd, EPOLLIN, grn_fd_nonblocking(sockfd),
+         accept_return = grn_sys_accept(sockfd, addr, addrlen));
+  return accept_return;
+}
+
+/**
+ * connect() for green threads.
+ *
+ * The connection is started in nonblocking mode (the socket's own mode is
+ * restored afterwards if it was blocking) and the thread parks until the
+ * socket becomes writable, which is when the handshake has finished one way
+ * or the other.
+ *
+ * @return 0 once connected, -1 with errno set to the connection error otherwise
+ */
+int grn_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+  int flags = fcntl(sockfd, F_GETFL);
+  if (flags == -1) return -1;
+
+  if (!(flags & O_NONBLOCK)) fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+  int connect_return = grn_sys_connect(sockfd, addr, addrlen);
+  int connect_errno = errno;
+  if (!(flags & O_NONBLOCK)) fcntl(sockfd, F_SETFL, flags);
+
+  if (connect_return == 0 || connect_errno != EINPROGRESS) {
+    errno = connect_errno;
+    return connect_return;
+  }
+
+  if (grn_fd_wait(sockfd, EPOLLOUT) == GRN_FD_CLOSED) return -1;
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return -1;
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Waits for one of several fds to become ready, with the semantics of poll().
+ *
+ * The current thread is parked on every fd in `fds` at once, for reading
+ * and/or writing as requested, and woken by the first of them to become ready
+ * or by the timeout. The `revents` of `fds` are filled in by poll() itself
+ * once the thread wakes up.
+ *
+ * @param fds the fds and events to wait for, as for poll()
+ * @param nfds the number of entries in `fds`
+ * @param timeout milliseconds to wait at most, -1 to wait indefinitely
+ *
+ * @return the number of entries with nonzero revents, 0 on timeout, -1 on error
+ */
+int grn_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  int ready = grn_sys_poll(fds, nfds, 0);
+  if (ready != 0 || timeout == 0) {
+    if (ready > 0) grn_coop_charge();
+    return ready;
+  }
+
+  grn_preempt_disable();
+
+  // One waiter for each direction of each fd
+  grn_waiter *waiters = calloc(nfds * 2, sizeof(grn_waiter));
+  assert_malloc(waiters);
+
+  grn_timer timer = {0};
+  uint64_t deadline = timeout > 0 ? grn_now() + (uint64_t)timeout * 1000000 : 0;
+
+  for (;;) {
+    bool parked = false;
+
+    for (nfds_t i = 0; i < nfds; i++) {
+      if (fds[i].fd < 0) continue;
+
+      grn_fd_record *record = grn_fd_get(fds[i].fd);
+
+      if (fds[i].events & (POLLIN | POLLPRI)) {
+        waiters[2 * i].events = EPOLLIN;
+        parked |= grn_fd_enqueue(record, &waiters[2 * i]) == 0;
+      }
+
+      if (fds[i].events & POLLOUT) {
+        waiters[2 * i + 1].events = EPOLLOUT;
+        parked |= grn_fd_enqueue(record, &waiters[2 * i + 1]) == 0;
+      }
+    }
+
+    if (timeout > 0) grn_timer_add(&timer, deadline);
+
+    // Nothing to wait on and no timeout would be parked forever, poll() itself
+    // reports the error (or the unpollable fd as ready) below
+    if (parked || timeout > 0) {
+      STATE.current->status = WAITING;
+      grn_yield();
+    }
+
+    for (nfds_t i = 0; i < nfds * 2; i++) {
+      grn_waitq_remove(&waiters[i]);
+    }
+    grn_timer_remove(&timer);
+
+    ready = grn_sys_poll(fds, nfds, 0);
+    if (ready != 0 || timer.fired || (!parked && timeout <= 0)) break;
+  }
+
+  free(waiters);
+  grn_preempt_enable();
+
+  return ready;
+}
@@ -14,6 +14,7 @@
 
 #include "chloros.h"
 #include "main.h"
+#include "probes.h"
 #include "thread.h"
 #include "utils.h"
 
@@ -24,12 +25,18 @@
 #undef free
 
 /*
- * Initial global state.
+ * Initial state of every kernel thread's scheduler.
  */
-chloros_state STATE = {
+__thread chloros_state STATE = {
     .active_threads = NULL,
     .waiting_threads = NULL,
-    .current = NULL};
+    .current = NULL,
+    .inbox_fd = -1,
+    .rq_policy = &grn_policy_priority};
+
+__thread bool grn_scheduler_thread = false;
+
+chloros_state *grn_home_state = NULL;
 
 /**
  * Signal Handler for timer interrupts
@@ -38,14 +45,21 @@ chloros_state STATE = {
  */
 void grn_handle_interrupt(int signum) {
   UNUSED(signum);
+
+  // The timer counts the whole process's CPU time, so the signal can land on
+  // any kernel thread that doesn't block it
+  if (!grn_scheduler_thread) return;
   debug("Thread %" PRId64 " interrupted\n", STATE.current->id);
 
   if (STATE.current->preempt_count > 0) {
     debug("Not rescheduling Thread %" PRId64 "\n", STATE.current->id);
+    GRN_PROBE2(preempt, STATE.current->id, 1);
     STATE.current->should_reschedule = true;
     return;
   }
 
+  GRN_PROBE2(preempt, STATE.current->id, 0);
+
   grn_yield();
 }
 
@@ -87,14 +101,33 @@ void grn_interrupt_init() {
  *
  * Creates the initial green thread from the currently executing context. The
  * `preempt` parameters specifies whether the scheduler is preemptive or not.
- * This function should only be called once.
+ * This function should only be called once. The scheduling policy is taken
+ * from the CHLOROS_SCHED environment variable, see grn_policy_from_env().
  *
  * @param preempt true if the scheduler should preempt, false otherwise
  */
 void grn_init(bool preempt) {
+  grn_init_policy(preempt, grn_policy_from_env());
+}
+
+/**
+ * Like grn_init(), but schedules with `policy`, see grn_set_policy().
+ *
+ * @param preempt true if the scheduler should preempt, false otherwise
+ * @param policy the scheduling policy, NULL for grn_policy_priority
+ */
+void grn_init_policy(bool preempt, const grn_policy *policy) {
+  if (grn_set_policy(policy != NULL ? policy : &grn_policy_priority) == -1) {
+    err_exit("grn_init_policy: invalid scheduling policy\n");
+  }
+
+  STATE.coop_budget = COOP_BUDGET;
   STATE.current = grn_new_thread(false);
   assert_malloc(STATE.current);
   STATE.current->status = RUNNING;
+  grn_rq_start(STATE.current);
+
+  grn_scheduler_thread = true;
 
   STATE.epfd = epoll_create1(0);
 
@@ -102,12 +135,42 @@ void grn_init(bool preempt) {
     fprintf(stderr, "WARNING: Could not create EPOLL Instance\n");
   }
 
+  grn_inbox_init();
+  if (STATE.shard == NULL) __atomic_store_n(&grn_home_state, &STATE, __ATOMIC_RELEASE);
+
   if (preempt) {
     // The user has requested preemption. Enable the functionality.
     grn_interrupt_init();
   }
 }
 
+/**
+ * Yields to `new_thread`, just made by grn_create(), if it's at least as
+ * urgent as the current thread, as grn_spawn() does.
+ *
+ * @return the ID of `new_thread`
+ */
+int grn_start(grn_thread *new_thread) {
+  // A thread we yield to runs ahead of the others of its level
+  if (new_thread->priority <= STATE.current->priority) {
+    grn_preempt_disable();
+    grn_rq_remove(new_thread);
+    grn_rq_enqueue(new_thread, true);
+    grn_preempt_enable();
+  }
+
+  grn_yield();
+
+  return new_thread->id;
+}
+
+/**
+ * Creates a thread with grn_create() and yields to it.
+ */
+static int grn_spawn_into(grn_fn fn, void *arg, int priority, grn_group *group) {
+  return grn_start(grn_create(fn, arg, priority, group));
+}
+
 /**
  * Creates a new green thread and executes `fn` inside that thread.
  *
@@ -121,6 +184,54 @@ void grn_init(bool preempt) {
  * @return The thread ID of the newly spawned process.
  */
 int grn_spawn(grn_fn fn, void *arg) {
+  return grn_spawn_prio(fn, arg, GRN_PRIO_DEFAULT);
+}
+
+/**
+ * Like grn_spawn(), but the new thread runs at priority `priority`. The
+ * current thread only yields to it right away if it's at least as urgent as
+ * the current thread.
+ *
+ * @param priority the priority level, GRN_PRIO_HIGHEST (0) to GRN_PRIO_LOWEST
+ *
+ * @return The thread ID of the new thread, or -1 with errno set to EINVAL if
+ *         `priority` is out of range
+ */
+int grn_spawn_prio(grn_fn fn, void *arg, int priority) {
+  if (priority < GRN_PRIO_HIGHEST || priority > GRN_PRIO_LOWEST) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return grn_spawn_into(fn, arg, priority, STATE.current->group);
+}
+
+/**
+ * Like grn_spawn(), but the new thread runs in `group` rather than the
+ * current thread's group. Threads spawned from it inherit the group.
+ *
+ * @return The thread ID of the new thread, or -1 with errno set to EINVAL if
+ *         `group` is NULL
+ */
+int grn_spawn_group(grn_group *group, grn_fn fn, void *arg) {
+  if (group == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return grn_spawn_into(fn, arg, GRN_PRIO_DEFAULT, group);
+}
+
+/**
+ * Creates a new READY green thread that will run `fn(arg)`, without yielding
+ * to it. Used to start several threads at once, as grn_listen_serve() does.
+ * The thread is queued behind the other threads of its priority level.
+ *
+ * @param group the group to run the thread in, or NULL
+ *
+ * @return the new thread
+ */
+grn_thread *grn_create(grn_fn fn, void *arg, int priority, grn_group *group) {
   grn_preempt_disable();
   grn_thread *new_thread = grn_new_thread(true);
   // When the context switch enters this thread and returns, we should be in start_thread
@@ -133,13 +244,18 @@ int grn_spawn(grn_fn fn, void *arg) {
   stackq[stack_sizeq - 1] = (uint64_t)fn;
   new_thread->context.rsp = (uint64_t)&stackq[stack_sizeq - 4];
 
+  new_thread->fn = fn;
   new_thread->status = READY;
+  new_thread->priority = priority;
+  new_thread->group = group;
+  if (group != NULL) group->threads++;
+  grn_rq_enqueue(new_thread, false);
 
-  grn_preempt_enable();
+  GRN_PROBE3(spawn, new_thread->id, fn, arg);
 
-  grn_yield();
+  grn_preempt_enable();
 
-  return new_thread->id;
+  return new_thread;
 }
 
 /**
@@ -171,37 +287,107 @@ void grn_gc() {
   }
 }
 
-struct epoll_event events[MAX_EVENTS];
+static __thread struct epoll_event events[MAX_EVENTS];
 
 /*
  * Runs epoll_wait() and moves any threads that have an event on them to active_threads
  * so they can be scheduled and do their I/O operation
  *
- *
+ * Events are dispatched to the fd's wait record, which decides which of the
+ * threads parked on it to wake.
  */
 void grn_epoll(int timeout) {
 
   // Instant timeout, we just want to see if anything has become ready while other threads were running
-  int epoll_ready_count = epoll_wait(STATE.epfd, events, MAX_EVENTS, timeout);
+  // Profiling signals can interrupt a blocking wait, which shouldn't look like a wakeup
+  int epoll_ready_count;
+  do {
+    // Don't sleep past the next timer
+    epoll_ready_count = epoll_wait(STATE.epfd, events, MAX_EVENTS, grn_timer_timeout(timeout));
+  } while (epoll_ready_count == -1 && errno == EINTR);
 
   for (int i = 0; i < epoll_ready_count; i++) {
-    // The event this thread is waiting on has happened
-    grn_thread *thread = (grn_thread *)events[i].data.ptr;
+    debug("fd %d has an epoll event ready\n", events[i].data.fd);
 
-    debug("Thread %" PRId64 " has an epoll event ready\n", thread->id);
+    if (grn_inbox_event(events[i].data.fd)) continue;
 
-    assert(thread->status == WAITING);
+    // Move the threads waiting on it to active so they can be scheduled
+    grn_fd_ready(events[i].data.fd, events[i].events);
+  }
+
+  grn_timer_fire();
+}
 
-    // Move it to active so it can be scheduled
-    move_thread_to_active(thread);
+/**
+ * Waits for an event when no thread is READY, see grn_set_idle_spin(). Polls
+ * without blocking until a thread becomes READY or the spin window runs out,
+ * then blocks in epoll_wait(). The window doubles after a spin that found work
+ * and halves after one that didn't, down to an eighth of the maximum, so a
+ * server that stops getting quick wakeups stops burning the CPU for nothing.
+ *
+ * @param prev the thread that yielded, which may be woken while we poll
+ */
+static void grn_epoll_idle(grn_thread *prev) {
+  if (STATE.spin_max_us == 0) {
+    grn_epoll(-1);
+    return;
   }
+
+  uint64_t deadline = grn_now() + (uint64_t)STATE.spin_us * 1000;
+
+  do {
+    grn_epoll(0);
+
+    // A RUNNING prev held back by its group's quota isn't work, it waits for
+    // the refill timer like everyone else
+    if (!grn_rq_empty() || (prev->status == RUNNING && !prev->rq_held)) {
+      STATE.spin_us *= 2;
+      if (STATE.spin_us > STATE.spin_max_us) STATE.spin_us = STATE.spin_max_us;
+      return;
+    }
+  } while (grn_now() < deadline);
+
+  uint32_t floor = STATE.spin_max_us / 8 > 0 ? STATE.spin_max_us / 8 : 1;
+  STATE.spin_us = STATE.spin_us / 2 > floor ? STATE.spin_us / 2 : floor;
+
+  grn_epoll(-1);
+}
+
+/**
+ * Makes the scheduler poll for events for up to `max_us` microseconds before
+ * blocking in epoll_wait() when every thread is waiting. A wakeup that arrives
+ * while it spins is picked up without the kernel having to wake the process,
+ * trading CPU time for latency. The window adapts to how often spinning pays
+ * off, see grn_epoll_idle().
+ *
+ * @param max_us the longest spin in microseconds, 0 disables spinning (the
+ *               default)
+ */
+void grn_set_idle_spin(uint32_t max_us) {
+  STATE.spin_max_us = max_us;
+  STATE.spin_us = max_us;
+}
+
+/**
+ * Asks the kernel to busy poll the device queues of the sockets threads park
+ * on for up to `us` microseconds when they have no data (SO_BUSY_POLL), which
+ * pairs with grn_set_idle_spin(). Applies to sockets registered with epoll
+ * from now on. Raising it above the net.core.busy_read sysctl needs
+ * CAP_NET_ADMIN, sockets that refuse it are waited on as usual.
+ *
+ * @param us the busy poll time in microseconds, 0 for none (the default)
+ */
+void grn_set_busy_poll(uint32_t us) {
+  STATE.busy_poll_us = us;
 }
 
 /**
  * Yields the execution time of the current thread to another thread.
  *
- * If there is at least one READY thread, this function chooses one through an
- * arbitrary search and context switches into it. The current thread is marked
+ * If there is at least one READY thread, this function takes the next one from
+ * the run queues (see grn_rq_pick()) and context switches into it. A RUNNING
+ * current thread is queued again first, so it keeps running if the policy
+ * (see grn_set_policy()) doesn't prefer another thread. The current thread is marked
  * READY if it was previous RUNNING, otherwise, its status remained unchanged.
  * The status of the thread being switched to is marked RUNNING. If no READY
  * thread is found, this function return -1. Otherwise, it returns 0.
@@ -214,36 +400,33 @@ int grn_yield() {
 
   debug("Thread %" PRId64 " is yielding\n", STATE.current->id);
 
-  grn_gc();
-  if ((STATE.current->status != WAITING && STATE.current->status != JOINABLE) || next_thread(STATE.current) != STATE.current) {
-    grn_epoll(0);
-  } else {
-    // Handle the case where all the threads are waiting
-    debug("No threads are active, blocking on epoll\n");
-    move_thread_to_waiting(STATE.current);
-    grn_epoll(-1);
+  // Charged before polling, so time spent blocked in epoll isn't counted
+  grn_rq_charge(STATE.current);
 
-    // We don't want to call move_thread_to_active twice
-    // But regardless of whether this thread was woken up by epoll
-    // It needs to be on the active list, so it can later be moved back to waiting on line 250
-    if (STATE.current->status != READY) {
-      move_thread_to_active(STATE.current);
-      STATE.current->status = WAITING;
-    }
-  }
+  grn_gc();
+  grn_epoll(0);
 
   grn_thread *prev = STATE.current;
 
-  // We start our search for the next thread to run at the next thread pointed to by our current thread in the linked list
-  grn_thread *next = next_thread(prev);
+  if (prev->status == RUNNING) grn_rq_enqueue(prev, false);
 
-  // We loop until we find a ready thread, or until we've searched through all the threads and looped back to the original one
-  while (next->status != READY && next != prev) {
-    next = next_thread(next);
+  // Handle the case where all the threads are waiting, or held back by their
+  // group's quota. The current thread stays on the active list while we block,
+  // if its own event arrives it is simply marked RUNNING again (see
+  // grn_wake_thread)
+  grn_thread *next;
+  while ((next = grn_rq_pick()) == NULL) {
+    debug("No threads are active, blocking on epoll\n");
+    grn_epoll_idle(prev);
+    if (prev->status == RUNNING && !prev->in_rq) grn_rq_enqueue(prev, false);
   }
 
-  // If we got back to the original thread, that means we couldn't find anything else to schedule, so we return -1 to indicate that no yielding happened
+  // If we got the original thread back, nothing more urgent wants to run, so we return -1 to indicate that no yielding happened
   if (next == prev) {
+    // Nobody else wants to run, so there's nothing to be fair to
+    prev->budget = STATE.coop_budget;
+    prev->should_reschedule = false;
+    grn_rq_start(prev);
     grn_preempt_enable();
     return -1;
   }
@@ -253,6 +436,8 @@ int grn_yield() {
 
   // Update statuses
   next->status = RUNNING;
+  next->budget = STATE.coop_budget;
+  grn_rq_start(next);
 
   // Reset their should_reschedule flags
   prev->should_reschedule = false;
@@ -265,29 +450,47 @@ int grn_yield() {
     move_thread_to_waiting(prev);
   } else if (prev->status == JOINABLE) {
     move_thread_to_joinable(prev);
+    // Nobody will join a detached thread, it can be collected as soon as
+    // we're off its stack
+    if (prev->detached) prev->status = ZOMBIE;
   }
 
+  GRN_PROBE2(switch_out, prev->id, next->id);
+
   grn_context_switch(&prev->context, &next->context);
 
+  GRN_PROBE1(switch_in, STATE.current->id);
+
   grn_preempt_enable();
 
   return 0;
 }
 
 /**
- * Blocks until all threads are finished executing.
+ * Blocks until all threads are finished executing, or parked: it returns as
+ * soon as no other thread is READY.
  *
- * TODO: Keep track of parent->children relationships so that a thread only
- * waits for the threads it spawned. TODO: Take in a list of thread IDs as a
- * parameter and wait for those threads.
+ * It is deliberately left as a loop around grn_yield(), not a wait on a
+ * count of live threads. Tests, examples and shards rely on it returning
+ * while threads are still parked on I/O or timers. To wait for particular
+ * threads, and park rather than yield while they run, use a grn_scope or a
+ * grn_waitgroup.
  *
  * @return 0 on successful wait, nonzero otherwise
  */
 int grn_wait() {
-  // Loop until grn_yield returns nonzero.
-  while (!grn_yield())
+  // Drop to the lowest priority so threads of every level get to run, we're
+  // back as soon as nothing else is READY
+  int priority = STATE.current->priority;
+  STATE.current->priority = GRN_PRIO_LOWEST;
+
+  // Loop until grn_yield returns nonzero with nothing else READY, some
+  // policies keep running us while other threads are READY
+  while (grn_yield() == 0 || !grn_rq_empty())
     ;
 
+  STATE.current->priority = priority;
+
   return 0;
 }
 /**
@@ -341,7 +544,9 @@ int grn_join(int64_t thread_id, void **return_value_ptr) {
     }
   }
 
-  if (join_target == NULL || join_target->status == ZOMBIE || join_target->waiting != NULL) {
+  if (join_target == NULL || join_target->status == ZOMBIE || join_target->detached ||
+      join_target->waiting != NULL) {
+    grn_preempt_enable();
     return -1; // Can't join this thread
   }
 
@@ -380,6 +585,7 @@ int grn_join(int64_t thread_id, void **return_value_ptr) {
 void grn_exit(void *ret) {
   grn_preempt_disable();
   debug("Thread %" PRId64 " is exiting.\n", STATE.current->id);
+  GRN_PROBE2(exit, STATE.current->id, ret);
   if (STATE.current->id == 0) {
     grn_gc();
     exit(0);
@@ -387,6 +593,16 @@ void grn_exit(void *ret) {
 
   STATE.current->return_value = ret;
 
+  if (STATE.current->painted) {
+    grn_stack_record(STATE.current);
+  }
+
+  if (STATE.current->on_exit != NULL) {
+    STATE.current->on_exit(STATE.current->on_exit_arg);
+  }
+
+  if (STATE.current->group != NULL) STATE.current->group->threads--;
+
   // A thread must be joined before it can be garbage collected
   // TODO: Let the user indicate whether they want a thread to be joinable at creation
   STATE.current->status = JOINABLE;
@@ -401,6 +617,7 @@ void grn_exit(void *ret) {
 }
 
 void grn_preempt_enable() {
+  if (!grn_scheduler_thread) return;
 
   STATE.current->preempt_count--;
 
@@ -410,6 +627,8 @@ void grn_preempt_enable() {
 }
 
 void grn_preempt_disable() {
+  if (!grn_scheduler_thread) return;
+
   STATE.current->preempt_count++;
 }
 
@@ -458,90 +677,3 @@ void chloros_free(void *ptr) {
   free(ptr);
   grn_preempt_enable();
 }
-
-// read()/write() syscall wrappers
-
-ssize_t grn_read(int fd, void *buf, size_t count) {
-  grn_preempt_disable();
-
-  struct epoll_event event;
-
-  event.events = EPOLLIN;
-  event.data.ptr = STATE.current;
-
-  int err = epoll_ctl(STATE.epfd, EPOLL_CTL_ADD, fd, &event);
-
-  // TODO: check errno and inform user if they used a duplicate file descriptor
-  if (err == -1) {
-    fprintf(stderr, "Could not add fd %d to epoll\n", fd);
-  }
-
-  STATE.current->status = WAITING;
-  grn_preempt_enable();
-  grn_yield();
-
-  grn_preempt_disable();
-
-  ssize_t bytes_read = read(fd, buf, count);
-
-  epoll_ctl(STATE.epfd, EPOLL_CTL_DEL, fd, NULL);
-
-  grn_preempt_enable();
-
-  return bytes_read;
-}
-
-ssize_t grn_write(int fd, const void *buf, size_t count) {
-  grn_preempt_disable();
-
-  struct epoll_event event;
-  event.events = EPOLLOUT;
-  event.data.ptr = STATE.current;
-
-  int err = epoll_ctl(STATE.epfd, EPOLL_CTL_ADD, fd, &event);
-
-  if (err == -1) {
-    fprintf(stderr, "Could not add fd %d to epoll\n", fd);
-  }
-
-  STATE.current->status = WAITING;
-  grn_yield();
-  grn_preempt_enable();
-  grn_preempt_disable();
-
-  ssize_t bytes_written = write(fd, buf, count);
-
-  epoll_ctl(STATE.epfd, EPOLL_CTL_DEL, fd, NULL);
-
-  grn_preempt_enable();
-
-  return bytes_written;
-}
-
-// accept() wrapper
-int grn_accept(int sockfd, struct sockaddr *restrict addr, socklen_t *restrict addrlen) {
-  grn_preempt_disable();
-
-  struct epoll_event event;
-  event.events = EPOLLIN;
-  event.data.ptr = STATE.current;
-
-  int err = epoll_ctl(STATE.epfd, EPOLL_CTL_ADD, sockfd, &event);
-
-  if (err == -1) {
-    fprintf(stderr, "Could not add fd %d to epoll\n", sockfd);
-  }
-
-  STATE.current->status = WAITING;
-  grn_yield();
-  grn_preempt_enable();
-  grn_preempt_disable();
-
-  int accept_return = accept(sockfd, addr, addrlen);
-
-  epoll_ctl(STATE.epfd, EPOLL_CTL_DEL, sockfd, NULL);
-
-  grn_preempt_enable();
-
-  return accept_return;
-}
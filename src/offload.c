@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "offload.h"
+#include "thread.h"
+
+/**
+ * A call waiting for, or being run by, a worker. Lives on the stack of the
+ * green thread that offloaded it.
+ */
+typedef struct grn_offload_job_struct {
+  grn_fn fn;
+  void *arg;
+  void *result;
+  int err;
+  grn_waker done;
+  struct grn_offload_job_struct *next;
+} grn_offload_job;
+
+/*
+ * The pool is shared with the worker threads, and by every shard, so
+ * everything here is guarded by `lock`. A finished job wakes its thread
+ * through the job's waker, which goes through the inbox of the thread's
+ * scheduler.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static grn_offload_job *pending_head = NULL;
+static grn_offload_job *pending_tail = NULL;
+
+static int workers_started = 0;
+
+static void *grn_offload_worker_main(void *unused) {
+  (void)unused;
+
+  pthread_mutex_lock(&lock);
+
+  for (;;) {
+    while (pending_head == NULL) {
+      pthread_cond_wait(&pending_cond, &lock);
+    }
+
+    grn_offload_job *job = pending_head;
+    pending_head = job->next;
+    if (pending_head == NULL) pending_tail = NULL;
+
+    pthread_mutex_unlock(&lock);
+
+    errno = 0;
+    job->result = job->fn(job->arg);
+    job->err = errno;
+
+    // The job may be gone as soon as its thread is woken
+    grn_wake(&job->done);
+
+    pthread_mutex_lock(&lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts the workers if they haven't been yet. Must be called with `lock`
+ * held.
+ *
+ * @return 0 if the pool can take jobs, -1 otherwise
+ */
+static int grn_offload_start() {
+  // Finished jobs come back through the inbox
+  if (STATE.inbox_fd == -1) return -1;
+
+  while (workers_started < OFFLOAD_WORKERS) {
+    // Workers inherit our signal mask, and must never take the scheduler's
+    // preemption or profiling signals
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t worker;
+    int err = pthread_create(&worker, NULL, grn_offload_worker_main, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) break;
+
+    pthread_detach(worker);
+    workers_started++;
+  }
+
+  return workers_started > 0 ? 0 : -1;
+}
+
+/**
+ * Runs `fn(arg)` on a kernel thread from the offload pool and parks the
+ * calling green thread until it returns, so blocking calls (open(), stat(),
+ * fsync(), getaddrinfo(), ...) don't block every other green thread.
+ *
+ * `fn` runs on a kernel thread outside the scheduler, so it must not call
+ * grn_* functions (malloc() and free() through chloros.h are fine). errno as
+ * left by `fn` is passed back. If the pool can't be started, `fn` runs inline.
+ *
+ * @param fn the blocking function to run
+ * @param arg the argument to pass to `fn`
+ *
+ * @return what `fn` returned
+ */
+void *grn_offload(grn_fn fn, void *arg) {
+  grn_offload_job job = {.fn = fn, .arg = arg};
+  grn_waker_init(&job.done);
+
+  grn_preempt_disable();
+  pthread_mutex_lock(&lock);
+
+  if (grn_offload_start() == -1) {
+    pthread_mutex_unlock(&lock);
+    grn_preempt_enable();
+    return fn(arg);
+  }
+
+  if (pending_tail != NULL) {
+    pending_tail->next = &job;
+  } else {
+    pending_head = &job;
+  }
+  pending_tail = &job;
+  pthread_cond_signal(&pending_cond);
+  pthread_mutex_unlock(&lock);
+
+  STATE.offload_jobs++;
+  grn_park(&job.done);
+  if (--STATE.offload_jobs == 0) grn_wake(&STATE.offload_idle);
+
+  grn_preempt_enable();
+
+  errno = job.err;
+  return job.result;
+}
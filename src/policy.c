@@ -0,0 +1,293 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chloros.h"
+#include "group.h"
+#include "main.h"
+
+/*
+ * The built-in scheduling policies, see grn_set_policy(). The FIFO, LIFO and
+ * priority policies share the per-level queues in STATE, FIFO and LIFO only
+ * using level 0.
+ */
+
+/*
+ * Relative CPU shares of the priority levels under grn_policy_fair, 1.25x per
+ * level around GRN_FAIR_WEIGHT_DEFAULT. A thread's vruntime advances by its
+ * runtime scaled by GRN_FAIR_WEIGHT_DEFAULT / its weight.
+ */
+#define GRN_FAIR_WEIGHT_DEFAULT 1024
+static const uint32_t grn_fair_weights[GRN_PRIO_LEVELS] = {2500, 2000, 1600, 1280,
+                                                           1024, 819,  655,  524};
+
+/**
+ * Adds `thread` to the FIFO queue of `level`.
+ *
+ * @param front true to add it at the head of the queue, false at the tail
+ */
+static void grn_queue_push(int level, grn_thread *thread, bool front) {
+  if (front) {
+    thread->rq_prev = NULL;
+    thread->rq_next = STATE.rq_heads[level];
+    if (STATE.rq_heads[level]) {
+      STATE.rq_heads[level]->rq_prev = thread;
+    } else {
+      STATE.rq_tails[level] = thread;
+    }
+    STATE.rq_heads[level] = thread;
+  } else {
+    thread->rq_next = NULL;
+    thread->rq_prev = STATE.rq_tails[level];
+    if (STATE.rq_tails[level]) {
+      STATE.rq_tails[level]->rq_next = thread;
+    } else {
+      STATE.rq_heads[level] = thread;
+    }
+    STATE.rq_tails[level] = thread;
+  }
+
+  STATE.rq_bitmap |= 1u << level;
+}
+
+/**
+ * Takes `thread` out of the FIFO queue of `level`.
+ */
+static void grn_queue_unlink(int level, grn_thread *thread) {
+  if (thread->rq_prev) {
+    thread->rq_prev->rq_next = thread->rq_next;
+  } else {
+    STATE.rq_heads[level] = thread->rq_next;
+  }
+
+  if (thread->rq_next) {
+    thread->rq_next->rq_prev = thread->rq_prev;
+  } else {
+    STATE.rq_tails[level] = thread->rq_prev;
+  }
+
+  if (STATE.rq_heads[level] == NULL) STATE.rq_bitmap &= ~(1u << level);
+}
+
+/*
+ * FIFO: one queue, the threads run in the order they became READY. Only
+ * spawned threads skip ahead.
+ */
+
+static void grn_fifo_enqueue(grn_thread *thread, bool front) {
+  grn_queue_push(0, thread, front);
+}
+
+static void grn_fifo_remove(grn_thread *thread) {
+  grn_queue_unlink(0, thread);
+}
+
+static grn_thread *grn_fifo_pick_next() {
+  return STATE.rq_heads[0];
+}
+
+const grn_policy grn_policy_fifo = {
+    .name = "fifo",
+    .enqueue = grn_fifo_enqueue,
+    .remove = grn_fifo_remove,
+    .pick_next = grn_fifo_pick_next,
+};
+
+/*
+ * LIFO: the thread that became READY last runs first, while whatever it was
+ * woken for is still in cache. A thread that yields goes behind every other
+ * thread, or it would just keep running.
+ */
+
+static void grn_lifo_enqueue(grn_thread *thread, bool front) {
+  (void)front;
+  grn_queue_push(0, thread, thread != STATE.current);
+}
+
+const grn_policy grn_policy_lifo = {
+    .name = "lifo",
+    .enqueue = grn_lifo_enqueue,
+    .remove = grn_fifo_remove,
+    .pick_next = grn_fifo_pick_next,
+};
+
+/*
+ * Priority: a FIFO queue per priority level, and a bit per non-empty level in
+ * STATE.rq_bitmap.
+ */
+
+static void grn_priority_enqueue(grn_thread *thread, bool front) {
+  grn_queue_push(thread->priority, thread, front);
+}
+
+static void grn_priority_remove(grn_thread *thread) {
+  grn_queue_unlink(thread->priority, thread);
+}
+
+/**
+ * Returns the head of the highest priority non-empty level, unless aging is
+ * enabled and the head of a lower level has waited longer than the aging
+ * limit.
+ */
+static grn_thread *grn_priority_pick_next() {
+  int level = __builtin_ctz(STATE.rq_bitmap);
+  grn_thread *next = STATE.rq_heads[level];
+
+  if (STATE.rq_aging > 0) {
+    // Heads are the longest waiting threads of their level, so they're the
+    // only ones that can have gone over the limit
+    uint32_t lower = STATE.rq_bitmap & ~((2u << level) - 1);
+    while (lower != 0) {
+      grn_thread *head = STATE.rq_heads[__builtin_ctz(lower)];
+      if (STATE.rq_picks - head->rq_enqueued > STATE.rq_aging) {
+        next = head;
+        break;
+      }
+      lower &= lower - 1;
+    }
+  }
+
+  return next;
+}
+
+const grn_policy grn_policy_priority = {
+    .name = "priority",
+    .enqueue = grn_priority_enqueue,
+    .remove = grn_priority_remove,
+    .pick_next = grn_priority_pick_next,
+};
+
+/*
+ * Fair: the READY threads are in a pairing heap ordered by vruntime, the CPU
+ * time they've had, weighted by their priority and group shares. The lowest
+ * vruntime runs next.
+ */
+
+/**
+ * Makes the root with the larger vruntime the leftmost child of the other,
+ * `b` on a tie.
+ *
+ * @return the root of the combined heap
+ */
+static grn_thread *grn_heap_meld(grn_thread *a, grn_thread *b) {
+  if (b->vruntime < a->vruntime) {
+    grn_thread *tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  b->rq_prev = a;
+  b->rq_next = a->rq_child;
+  if (a->rq_child) a->rq_child->rq_prev = b;
+  a->rq_child = b;
+
+  return a;
+}
+
+/**
+ * Combines the sibling list starting at `first` into one heap, pairing
+ * neighbours left to right and then melding the pairs right to left.
+ *
+ * @return the root of the combined heap, NULL if `first` is NULL
+ */
+static grn_thread *grn_heap_merge_pairs(grn_thread *first) {
+  // The pairs, last one first
+  grn_thread *pairs = NULL;
+
+  while (first != NULL) {
+    grn_thread *a = first;
+    grn_thread *b = a->rq_next;
+    first = b != NULL ? b->rq_next : NULL;
+
+    a->rq_prev = a->rq_next = NULL;
+    if (b != NULL) {
+      b->rq_prev = b->rq_next = NULL;
+      a = grn_heap_meld(a, b);
+    }
+
+    a->rq_next = pairs;
+    pairs = a;
+  }
+
+  grn_thread *root = pairs;
+  if (root == NULL) return NULL;
+
+  pairs = root->rq_next;
+  root->rq_next = NULL;
+
+  while (pairs != NULL) {
+    grn_thread *next = pairs->rq_next;
+    pairs->rq_next = NULL;
+    root = grn_heap_meld(root, pairs);
+    pairs = next;
+  }
+
+  return root;
+}
+
+/**
+ * Adds a READY `thread` to the vruntime heap. A thread that has been away,
+ * waiting or new, comes back at the current minimum vruntime rather than with
+ * credit for the time it wasn't READY.
+ */
+static void grn_fair_enqueue(grn_thread *thread, bool front) {
+  (void)front;
+
+  if (thread->vruntime < STATE.rq_min_vruntime) thread->vruntime = STATE.rq_min_vruntime;
+
+  thread->rq_prev = thread->rq_next = thread->rq_child = NULL;
+  STATE.rq_root = STATE.rq_root != NULL ? grn_heap_meld(STATE.rq_root, thread) : thread;
+}
+
+/**
+ * Takes `thread` out of the vruntime heap.
+ */
+static void grn_fair_remove(grn_thread *thread) {
+  grn_thread *children = grn_heap_merge_pairs(thread->rq_child);
+  thread->rq_child = NULL;
+
+  if (thread == STATE.rq_root) {
+    STATE.rq_root = children;
+    return;
+  }
+
+  // rq_prev is the parent if we're its leftmost child, our left sibling
+  // otherwise
+  if (thread->rq_prev->rq_child == thread) {
+    thread->rq_prev->rq_child = thread->rq_next;
+  } else {
+    thread->rq_prev->rq_next = thread->rq_next;
+  }
+  if (thread->rq_next) thread->rq_next->rq_prev = thread->rq_prev;
+
+  if (children != NULL) STATE.rq_root = grn_heap_meld(STATE.rq_root, children);
+}
+
+static grn_thread *grn_fair_pick_next() {
+  grn_thread *next = STATE.rq_root;
+  if (next->vruntime > STATE.rq_min_vruntime) STATE.rq_min_vruntime = next->vruntime;
+  return next;
+}
+
+/**
+ * Adds `ns` nanoseconds of CPU time to the vruntime of `thread`, scaled by its
+ * priority's weight and its group's shares.
+ */
+static void grn_fair_on_tick(grn_thread *thread, uint64_t ns) {
+  uint64_t scaled = ns * GRN_FAIR_WEIGHT_DEFAULT / grn_fair_weights[thread->priority];
+
+  grn_group *group = thread->group;
+  if (group != NULL) {
+    // The group's share is split between its threads
+    scaled = scaled * group->threads * GRN_GROUP_SHARES_DEFAULT / group->shares;
+  }
+
+  thread->vruntime += scaled;
+}
+
+const grn_policy grn_policy_fair = {
+    .name = "fair",
+    .enqueue = grn_fair_enqueue,
+    .remove = grn_fair_remove,
+    .pick_next = grn_fair_pick_next,
+    .on_tick = grn_fair_on_tick,
+};
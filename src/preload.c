@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "main.h"
+
+/*
+ * Interposes libc's blocking calls for code that wasn't written against
+ * chloros, e.g. third-party client libraries. Built into
+ * libchloros_preload.so together with the rest of the library. A program that
+ * links against it (or runs with it in LD_PRELOAD) has its read(), write(),
+ * connect(), accept(), poll() and nanosleep() calls park the calling green
+ * thread the way grn_read() does, wherever they come from, and its close()
+ * calls go through grn_close().
+ *
+ * The calls only go through chloros from a green thread on the scheduler's
+ * kernel thread. Before grn_init() and on other kernel threads (including the
+ * offload pool) they fall through to libc. The library's own calls, e.g. the
+ * read() grn_read() makes once the fd is ready, never get here: they're made
+ * with the grn_sys_* syscalls of utils.h.
+ */
+
+/**
+ * Returns true, and marks the current thread as inside the library, if the
+ * call should go through chloros.
+ */
+static bool grn_interpose_enter() {
+  grn_thread *thread = grn_current();
+
+  if (!grn_scheduler_thread || thread == NULL || thread->interposed) {
+    return false;
+  }
+
+  thread->interposed = true;
+  return true;
+}
+
+static void grn_interpose_exit() { grn_current()->interposed = false; }
+
+/*
+ * Defines `name` to call `green_call` from a green thread and the next
+ * definition of `name` (libc's) otherwise.
+ */
+#define GRN_INTERPOSE(ret_type, name, params, args, green_call)             \
+  ret_type name params {                                                    \
+    static ret_type(*real) params = NULL;                                   \
+    if (real == NULL) real = (ret_type(*) params)dlsym(RTLD_NEXT, #name);   \
+                                                                            \
+    if (!grn_interpose_enter()) return real args;                           \
+    ret_type ret = green_call;                                              \
+    grn_interpose_exit();                                                   \
+    return ret;                                                             \
+  }
+
+GRN_INTERPOSE(ssize_t, read, (int fd, void *buf, size_t count), (fd, buf, count),
+              grn_read(fd, buf, count))
+
+GRN_INTERPOSE(ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count),
+              grn_write(fd, buf, count))
+
+GRN_INTERPOSE(int, close, (int fd), (fd), grn_close(fd))
+
+GRN_INTERPOSE(int, connect, (int fd, const struct sockaddr *addr, socklen_t len), (fd, addr, len),
+              grn_connect(fd, addr, len))
+
+GRN_INTERPOSE(int, accept, (int fd, struct sockaddr *addr, socklen_t *len), (fd, addr, len),
+              grn_accept(fd, addr, len))
+
+GRN_INTERPOSE(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout),
+              grn_poll(fds, nfds, timeout))
+
+GRN_INTERPOSE(int, nanosleep, (const struct timespec *req, struct timespec *rem), (req, rem),
+              grn_nanosleep(req, rem))
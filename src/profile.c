@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "utils.h"
+
+#undef malloc
+#undef calloc
+#undef free
+
+/*
+ * Maximum number of program counters recorded for a single sample, and the
+ * number of samples kept before new ones are dropped.
+ */
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SAMPLES (1 << 14)
+
+
+typedef struct prof_sample_struct {
+  int64_t id;
+  grn_fn fn;
+  uint32_t depth;
+  uint64_t pcs[PROF_MAX_DEPTH];
+} prof_sample;
+
+static prof_sample *samples = NULL;
+static volatile uint32_t sample_count = 0;
+static volatile uint64_t dropped_count = 0;
+
+/*
+ * Top of the kernel thread's own stack, which green threads without a stack
+ * of their own (the main thread) run on. Looked up by grn_profile_start(),
+ * since pthread_getattr_np() can't be called from the handler. 0 on kernel
+ * threads it wasn't called on, whose main thread's stack isn't walked.
+ */
+static __thread uint64_t main_stack_high = 0;
+
+/**
+ * Walks the frame pointer chain starting at `fp`, storing return addresses
+ * into `pcs` after the already recorded ones. Frames are only followed while
+ * they stay inside [low, high) and move towards the top of the stack, so a
+ * garbage %rbp (e.g. from code built without frame pointers) ends the walk
+ * instead of faulting.
+ *
+ * @return the total number of program counters in `pcs`
+ */
+static uint32_t prof_walk(uint64_t fp, uint64_t low, uint64_t high, uint64_t *pcs,
+                          uint32_t depth) {
+  while (depth < PROF_MAX_DEPTH) {
+    if (fp < low || fp + 16 > high || (fp & 0x7) != 0) break;
+
+    uint64_t *frame = (uint64_t *)fp;
+    uint64_t ret = frame[1];
+    uint64_t next = frame[0];
+
+    if (ret == 0) break;
+    pcs[depth++] = ret;
+
+    if (next <= fp) break;
+    fp = next;
+  }
+
+  return depth;
+}
+
+/**
+ * SIGPROF handler. Records the interrupted green thread, the function it was
+ * spawned with and the program counters of its green stack.
+ */
+static void grn_handle_profile(int signum, siginfo_t *info, void *ucontext) {
+  UNUSED(signum);
+  UNUSED(info);
+
+  grn_thread *thread = STATE.current;
+  if (samples == NULL || thread == NULL || !grn_scheduler_thread) return;
+
+  if (sample_count >= PROF_MAX_SAMPLES) {
+    dropped_count++;
+    return;
+  }
+
+  mcontext_t *mc = &((ucontext_t *)ucontext)->uc_mcontext;
+  uint64_t rip = mc->gregs[REG_RIP];
+  uint64_t rbp = mc->gregs[REG_RBP];
+  uint64_t rsp = mc->gregs[REG_RSP];
+
+  uint64_t low, high;
+  if (thread->stack != NULL) {
+    low = (uint64_t)thread->stack;
+    high = low + STACK_SIZE;
+  } else {
+    // Frames are above %rsp, the stack may not be mapped below it
+    low = rsp;
+    high = main_stack_high;
+  }
+
+  prof_sample *sample = &samples[sample_count];
+  sample->id = thread->id;
+  sample->fn = thread->fn;
+  sample->pcs[0] = rip;
+  sample->depth = prof_walk(rbp, low, high, sample->pcs, 1);
+
+  sample_count++;
+}
+
+/**
+ * Starts sampling the running green threads `hz` times per second of
+ * process CPU time. Samples accumulate until grn_profile_dump() is called.
+ *
+ * @param hz the sampling frequency, must be between 1 and 1000000
+ *
+ * @return 0 on success, -1 if the profiler couldn't be started
+ */
+int grn_profile_start(int hz) {
+  if (hz <= 0 || hz > 1000000) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (samples == NULL) {
+    samples = calloc(PROF_MAX_SAMPLES, sizeof(prof_sample));
+    assert_malloc(samples);
+  }
+
+  pthread_attr_t attr;
+  void *stack_addr;
+  size_t stack_size;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+      main_stack_high = (uint64_t)stack_addr + stack_size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  struct sigaction prof_action;
+  prof_action.sa_sigaction = grn_handle_profile;
+  // A preemption in the middle of recording a sample would let another
+  // thread's sample land in the same slot
+  sigemptyset(&prof_action.sa_mask);
+  sigaddset(&prof_action.sa_mask, SIGVTALRM);
+  prof_action.sa_flags = SA_SIGINFO | SA_RESTART;
+
+  if (sigaction(SIGPROF, &prof_action, NULL) != 0) {
+    print_err("sigaction failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct itimerval itimer;
+  // tv_usec must stay below a second, 1 Hz is a whole second
+  itimer.it_interval.tv_sec = 1 / hz;
+  itimer.it_interval.tv_usec = (1000000 / hz) % 1000000;
+  itimer.it_value = itimer.it_interval;
+
+  if (setitimer(ITIMER_PROF, &itimer, NULL) != 0) {
+    print_err("setitimer failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Stops sampling. Samples collected so far are kept for grn_profile_dump().
+ */
+void grn_profile_stop() {
+  struct itimerval zero_timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &zero_timer, NULL);
+}
+
+static int prof_sample_cmp(const void *a, const void *b) {
+  const prof_sample *sa = a, *sb = b;
+
+  if (sa->id != sb->id) return sa->id < sb->id ? -1 : 1;
+  if (sa->depth != sb->depth) return sa->depth < sb->depth ? -1 : 1;
+
+  for (uint32_t i = 0; i < sa->depth; i++) {
+    if (sa->pcs[i] != sb->pcs[i]) return sa->pcs[i] < sb->pcs[i] ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Prints a single frame, preferring the symbol name when the dynamic linker
+ * knows it (link with -rdynamic for executables) and the raw address
+ * otherwise.
+ */
+static void prof_print_frame(FILE *out, uint64_t pc) {
+  Dl_info info;
+  if (dladdr((void *)pc, &info) && info.dli_sname != NULL) {
+    fputs(info.dli_sname, out);
+  } else {
+    fprintf(out, "0x%" PRIx64, pc);
+  }
+}
+
+/**
+ * Writes the collected samples to `out` in the folded-stack format consumed by
+ * flamegraph.pl and friends. Each stack is rooted at a frame naming the green
+ * thread and the function it was spawned with, e.g. `grn-3:handle;...;read 12`.
+ * The collected samples are discarded afterwards.
+ *
+ * @param out the stream to write to
+ */
+void grn_profile_dump(FILE *out) {
+  if (samples == NULL) return;
+
+  // Keep the handler from touching the buffer while we sort it
+  sigset_t prof_sig, old_sig;
+  sigemptyset(&prof_sig);
+  sigaddset(&prof_sig, SIGPROF);
+  sigprocmask(SIG_BLOCK, &prof_sig, &old_sig);
+
+  uint32_t count = sample_count;
+  qsort(samples, count, sizeof(prof_sample), prof_sample_cmp);
+
+  uint32_t i = 0;
+  while (i < count) {
+    uint32_t run = i + 1;
+    while (run < count && prof_sample_cmp(&samples[i], &samples[run]) == 0) {
+      run++;
+    }
+
+    prof_sample *sample = &samples[i];
+    fprintf(out, "grn-%" PRId64, sample->id);
+    if (sample->fn != NULL) {
+      fputc(':', out);
+      prof_print_frame(out, (uint64_t)sample->fn);
+    }
+
+    // Folded stacks are written root first
+    for (uint32_t d = sample->depth; d > 0; d--) {
+      fputc(';', out);
+      prof_print_frame(out, sample->pcs[d - 1]);
+    }
+
+    fprintf(out, " %" PRIu32 "\n", run - i);
+    i = run;
+  }
+
+  if (dropped_count > 0) {
+    fprintf(stderr, "WARNING: profiler dropped %" PRIu64 " samples\n", dropped_count);
+  }
+
+  sample_count = 0;
+  dropped_count = 0;
+
+  sigprocmask(SIG_SETMASK, &old_sig, NULL);
+}
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chloros.h"
+#include "group.h"
+#include "main.h"
+#include "runq.h"
+#include "thread.h"
+
+/*
+ * The scheduler's side of the run queues. The policy (see policy.c) only
+ * decides the order the READY threads run in. Holding back throttled groups,
+ * skipping threads that never became READY and CPU accounting happen here.
+ */
+
+/**
+ * Adds a READY `thread` to the run queues.
+ *
+ * @param thread a thread that isn't in a run queue
+ * @param front true if the thread was just spawned and should run soon, which
+ *              the policy may ignore
+ */
+void grn_rq_enqueue(grn_thread *thread, bool front) {
+  thread->rq_enqueued = STATE.rq_picks;
+  thread->in_rq = true;
+
+  if (grn_group_hold(thread)) return;
+
+  STATE.rq_policy->enqueue(thread, front);
+  STATE.rq_count++;
+}
+
+/**
+ * Takes `thread` out of the run queues, if it's in them.
+ */
+void grn_rq_remove(grn_thread *thread) {
+  if (!thread->in_rq) return;
+
+  // Threads in the run next slot or held back by their group aren't the
+  // policy's
+  if (thread == STATE.rq_run_next) {
+    STATE.rq_run_next = NULL;
+    STATE.rq_count--;
+  } else if (!grn_group_release(thread)) {
+    STATE.rq_policy->remove(thread);
+    STATE.rq_count--;
+  }
+
+  thread->in_rq = false;
+  thread->rq_prev = thread->rq_next = NULL;
+}
+
+/**
+ * @return true if no thread is in the run queues
+ */
+bool grn_rq_empty() {
+  return STATE.rq_count == 0;
+}
+
+/**
+ * Moves the thread in the run next slot, if any, into the policy's queues.
+ */
+static void grn_rq_flush_run_next() {
+  grn_thread *thread = STATE.rq_run_next;
+  if (thread == NULL) return;
+
+  STATE.rq_run_next = NULL;
+  STATE.rq_policy->enqueue(thread, false);
+}
+
+/**
+ * Returns the thread to run next, still queued: the one in the run next slot
+ * if it hasn't had too many turns in a row and is as urgent as the policy's
+ * choice, the policy's choice otherwise.
+ */
+static grn_thread *grn_rq_select() {
+  grn_thread *slot = STATE.rq_run_next;
+  if (slot == NULL || STATE.rq_count == 1) {
+    STATE.rq_run_next_streak = 0;
+    return slot != NULL ? slot : STATE.rq_policy->pick_next();
+  }
+
+  grn_thread *queued = STATE.rq_policy->pick_next();
+  if (STATE.rq_run_next_streak < STATE.rq_run_next_limit && slot->priority <= queued->priority) {
+    STATE.rq_run_next_streak++;
+    return slot;
+  }
+
+  // Threads handing off to each other through the slot would starve the rest,
+  // so after enough turns the slot's thread waits its turn like the others
+  grn_rq_flush_run_next();
+  STATE.rq_run_next_streak = 0;
+  return STATE.rq_policy->pick_next();
+}
+
+/**
+ * Takes the thread to run next out of the run queues, see grn_rq_select().
+ *
+ * @return the thread to run next, or NULL if no thread is READY, or all the
+ *         READY threads are held back by their groups
+ */
+grn_thread *grn_rq_pick() {
+  grn_thread *next;
+
+  for (;;) {
+    if (grn_rq_empty()) return NULL;
+    STATE.rq_picks++;
+    next = grn_rq_select();
+    grn_rq_remove(next);
+
+    // Threads enter their run queue when they're created, drop the ones that
+    // never became READY
+    if (next->status != READY && next->status != RUNNING) continue;
+    // Its group used up its quota since it was queued
+    if (grn_group_hold(next)) continue;
+    break;
+  }
+
+  return next;
+}
+
+/**
+ * Tells the policy the running `thread` is parking.
+ */
+void grn_rq_block(grn_thread *thread) {
+  if (STATE.rq_policy->on_block != NULL) STATE.rq_policy->on_block(thread);
+}
+
+/**
+ * Queues a parked `thread` that was woken. With the run next slot enabled it
+ * goes in the slot, bumping the thread that was there into the policy's
+ * queues, otherwise it's queued behind the threads that are already READY
+ * unless the policy says otherwise.
+ */
+void grn_rq_wake(grn_thread *thread) {
+  if (STATE.rq_policy->on_wake != NULL) STATE.rq_policy->on_wake(thread);
+
+  if (STATE.rq_run_next_limit == 0 || (thread->group != NULL && thread->group->throttled)) {
+    grn_rq_enqueue(thread, false);
+    return;
+  }
+
+  grn_rq_flush_run_next();
+
+  thread->rq_enqueued = STATE.rq_picks;
+  thread->in_rq = true;
+  STATE.rq_run_next = thread;
+  STATE.rq_count++;
+}
+
+/**
+ * @return true if the CPU time of `thread` has to be measured, for the policy
+ *         or its group
+ */
+static bool grn_rq_timed(grn_thread *thread) {
+  return STATE.rq_policy->on_tick != NULL || thread->group != NULL;
+}
+
+/**
+ * Charges `thread` for the time since grn_rq_start() was called on it: adds it
+ * to its runtime and its group's, and passes it to the policy's on_tick.
+ */
+void grn_rq_charge(grn_thread *thread) {
+  if (!grn_rq_timed(thread)) return;
+
+  uint64_t now = grn_now();
+  uint64_t delta = now - thread->run_start;
+  thread->runtime += delta;
+
+  if (STATE.rq_policy->on_tick != NULL) STATE.rq_policy->on_tick(thread, delta);
+  if (thread->group != NULL) grn_group_charge(thread->group, delta, now);
+}
+
+/**
+ * Starts timing `thread`, which is about to run.
+ */
+void grn_rq_start(grn_thread *thread) {
+  if (!grn_rq_timed(thread)) return;
+
+  thread->run_start = grn_now();
+}
+
+/**
+ * Returns the built-in policy named by the CHLOROS_SCHED environment variable,
+ * "fifo", "lifo", "priority" or "fair", so a program's policy can be changed
+ * without rebuilding it. grn_init() uses this.
+ *
+ * @return the policy, grn_policy_priority if the variable isn't set
+ */
+const grn_policy *grn_policy_from_env() {
+  static const grn_policy *builtin[] = {&grn_policy_priority, &grn_policy_fifo,
+                                        &grn_policy_lifo, &grn_policy_fair};
+
+  const char *name = getenv("CHLOROS_SCHED");
+  if (name == NULL || *name == '\0') return &grn_policy_priority;
+
+  for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+    if (strcmp(name, builtin[i]->name) == 0) return builtin[i];
+  }
+
+  fprintf(stderr, "WARNING: Unknown CHLOROS_SCHED policy '%s', using priority\n", name);
+  return &grn_policy_priority;
+}
+
+/**
+ * Switches the scheduling policy, moving the READY threads over to the new
+ * policy's run queues in the order the old one would have run them.
+ *
+ * The built-in policies are:
+ *  - grn_policy_priority (the default) always runs the most urgent READY
+ *    thread and goes round-robin within a priority level.
+ *  - grn_policy_fifo runs threads in the order they became READY.
+ *  - grn_policy_lifo runs the thread that became READY last first.
+ *  - grn_policy_fair tracks each thread's CPU time, scaled down for more
+ *    urgent priorities, and runs the READY thread that has had the least.
+ *
+ * @param policy the policy to use from now on
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if `policy` is NULL or is
+ *         missing one of enqueue, remove and pick_next
+ */
+int grn_set_policy(const grn_policy *policy) {
+  if (policy == NULL || policy->enqueue == NULL || policy->remove == NULL ||
+      policy->pick_next == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (policy == STATE.rq_policy) return 0;
+
+  grn_preempt_disable();
+
+  grn_rq_flush_run_next();
+
+  grn_thread *queued = NULL;
+  grn_thread **tail = &queued;
+  while (!grn_rq_empty()) {
+    grn_thread *thread = STATE.rq_policy->pick_next();
+    grn_rq_remove(thread);
+    *tail = thread;
+    tail = &thread->rq_next;
+  }
+
+  STATE.rq_policy = policy;
+
+  while (queued != NULL) {
+    grn_thread *next = queued->rq_next;
+    grn_rq_enqueue(queued, false);
+    queued = next;
+  }
+
+  if (STATE.current != NULL) grn_rq_start(STATE.current);
+
+  grn_preempt_enable();
+  return 0;
+}
+
+/**
+ * Enables the run next slot: a thread that is woken, e.g. by an epoll event,
+ * a grn_wake() or the thread it was joining exiting, runs next instead of
+ * queueing, while the data its waker just produced is still in cache. Only
+ * the most recently woken thread gets the slot, and it doesn't jump ahead of
+ * more urgent threads.
+ *
+ * Two threads waking each other could take turns in the slot forever, so the
+ * slot is bypassed after `limit` consecutive turns and the policy's choice
+ * runs instead.
+ *
+ * @param limit the most consecutive turns the slot gets, 0 disables it (the
+ *              default)
+ */
+void grn_set_run_next(uint32_t limit) {
+  grn_preempt_disable();
+
+  STATE.rq_run_next_limit = limit;
+  STATE.rq_run_next_streak = 0;
+  if (limit == 0) grn_rq_flush_run_next();
+
+  grn_preempt_enable();
+}
+
+/**
+ * Sets the priority of `thread`, 0 (GRN_PRIO_HIGHEST) being the most urgent
+ * and GRN_PRIO_LOWEST the least. A READY thread moves to the back of its new
+ * level. Lowering the priority of the running thread doesn't yield by itself.
+ *
+ * @param thread the thread to change
+ * @param priority the new priority level
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if `priority` is out of
+ *         range
+ */
+int grn_set_priority(grn_thread *thread, int priority) {
+  if (priority < GRN_PRIO_HIGHEST || priority > GRN_PRIO_LOWEST) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  grn_preempt_disable();
+
+  if (thread->in_rq) {
+    grn_rq_remove(thread);
+    thread->priority = priority;
+    grn_rq_enqueue(thread, false);
+  } else {
+    thread->priority = priority;
+  }
+
+  grn_preempt_enable();
+  return 0;
+}
+
+/**
+ * Enables aging for grn_policy_priority: a READY thread that has been passed
+ * over for more than `picks` scheduling decisions runs next regardless of
+ * priority, so a steady stream of high priority work can't starve lower
+ * levels forever.
+ *
+ * @param picks the most scheduling decisions a thread can wait, 0 disables
+ *              aging (the default)
+ */
+void grn_set_aging(uint32_t picks) {
+  STATE.rq_aging = picks;
+}
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "io.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * Shared between a grn_listen_serve() loop and the handlers it spawned. It's
+ * freed by whichever of them lets go of it last, so handlers can outlive a
+ * server that returned with an error.
+ */
+typedef struct grn_server_struct {
+  grn_thread *thread;
+  int active;
+  int refs;
+
+  /**
+   * true while the server is parked waiting for a handler to exit
+   */
+  bool waiting;
+} grn_server;
+
+static void grn_server_release(grn_server *server) {
+  if (--server->refs == 0) free(server);
+}
+
+/**
+ * Exit hook of the handler threads, runs with preemption disabled.
+ */
+static void grn_server_handler_exit(void *arg) {
+  grn_server *server = arg;
+
+  server->active--;
+  if (server->waiting) {
+    server->waiting = false;
+    grn_wake_thread(server->thread);
+  }
+
+  grn_server_release(server);
+}
+
+/**
+ * Returns true if accept() failed because of the connection or a passing
+ * condition rather than the listener, so the loop should carry on.
+ */
+static bool grn_accept_transient(int err) {
+  switch (err) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+    case EPERM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Accepts connections on the listening socket `fd` for as long as it can,
+ * running `handler` in a new detached green thread for each of them.
+ *
+ * The handler receives the connected fd as its argument, i.e. it's called as
+ * handler((void *)(intptr_t)conn), and must close it. Connections are accepted
+ * in nonblocking, close-on-exec mode. Each time the listener becomes readable
+ * its whole backlog is drained with accept4() until EAGAIN, creating the
+ * handlers without yielding to each in turn, and the new handlers run when the
+ * server parks again. The listener is switched to nonblocking mode.
+ *
+ * Handler threads are detached: they can't be joined and their return values
+ * are discarded. They run at the priority, and in the group, of the thread
+ * calling this.
+ *
+ * @param fd a bound, listening socket
+ * @param handler the function to run for each connection
+ * @param opts concurrency and batching limits, or NULL for none
+ *
+ * @return -1 with errno set if accepting failed with a non-transient error,
+ *         e.g. the listener was closed or the process ran out of fds. It
+ *         doesn't return otherwise.
+ */
+int grn_listen_serve(int fd, grn_fn handler, const grn_serve_opts *opts) {
+  int max_concurrency = opts != NULL ? opts->max_concurrency : 0;
+  int max_batch = opts != NULL ? opts->max_batch : 0;
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return -1;
+
+  grn_server *server = calloc(1, sizeof(grn_server));
+  assert_malloc(server);
+  server->thread = grn_current();
+  server->refs = 1;
+
+  int batch = 0;
+
+  for (;;) {
+    grn_preempt_disable();
+
+    // Leave connections in the kernel's backlog until a handler finishes
+    while (max_concurrency > 0 && server->active >= max_concurrency) {
+      server->waiting = true;
+      STATE.current->status = WAITING;
+      grn_yield();
+    }
+
+    grn_preempt_enable();
+
+    if (max_batch > 0 && batch >= max_batch) {
+      batch = 0;
+      grn_yield();
+    }
+
+    int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (conn == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The backlog is drained, the handlers get to run while we're parked
+        batch = 0;
+        if (grn_fd_wait(fd, EPOLLIN) == -1) break;
+        continue;
+      }
+
+      if (grn_accept_transient(errno)) continue;
+      break;
+    }
+
+    grn_preempt_disable();
+
+    grn_thread *thread = grn_create(handler, (void *)(intptr_t)conn, STATE.current->priority,
+                                    STATE.current->group);
+    thread->detached = true;
+    thread->on_exit = grn_server_handler_exit;
+    thread->on_exit_arg = server;
+
+    server->active++;
+    server->refs++;
+    batch++;
+
+    grn_preempt_enable();
+  }
+
+  int saved_errno = errno;
+  grn_preempt_disable();
+  grn_server_release(server);
+  grn_preempt_enable();
+  errno = saved_errno;
+
+  return -1;
+}
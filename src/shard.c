@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "inbox.h"
+#include "main.h"
+#include "shard.h"
+#include "utils.h"
+
+/*
+ * Shared-nothing mode: grn_shard_run() starts one scheduler per kernel
+ * thread, each pinned to a CPU with its own STATE (STATE is thread-local), so
+ * its own run queues, epoll set, timers and pools. Shards share nothing but
+ * what the application hands between them with grn_shard_submit(), which
+ * goes through the target's inbox like grn_spawn_external().
+ */
+
+#define GRN_SHARD_STARTING 0
+#define GRN_SHARD_GO 1
+#define GRN_SHARD_ABORT 2
+
+/*
+ * The current run. `gate` holds the shards back until all of them can take
+ * submissions, it's guarded by `gate_lock`.
+ */
+static grn_shard *shards = NULL;
+static int shard_count = 0;
+static int shards_running = 0;
+
+static grn_fn shard_fn;
+static void *shard_arg;
+static bool shard_preempt;
+
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate = GRN_SHARD_STARTING;
+static int shards_ready = 0;
+static int shards_stopped = 0;
+
+/**
+ * Pins the calling kernel thread to the `id`th CPU it's allowed to run on,
+ * wrapping around if there are more shards than CPUs.
+ */
+static void grn_shard_pin(int id) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+
+  int target = id % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+    return;
+  }
+}
+
+/**
+ * Waits for grn_shard_run() to start or abort the run.
+ *
+ * @return true if the shard should run
+ */
+static bool grn_shard_gate() {
+  pthread_mutex_lock(&gate_lock);
+
+  shards_ready++;
+  pthread_cond_broadcast(&gate_cond);
+  while (gate == GRN_SHARD_STARTING) pthread_cond_wait(&gate_cond, &gate_lock);
+  bool go = gate == GRN_SHARD_GO;
+
+  pthread_mutex_unlock(&gate_lock);
+  return go;
+}
+
+/**
+ * Waits for every shard to have stopped running threads. Until then another
+ * shard's threads may still grn_wake() one of ours that's parked, which goes
+ * through our inbox, so the STATE and the eventfd must stay around.
+ */
+static void grn_shard_barrier() {
+  pthread_mutex_lock(&gate_lock);
+
+  shards_stopped++;
+  pthread_cond_broadcast(&gate_cond);
+  while (shards_stopped < shard_count) pthread_cond_wait(&gate_cond, &gate_lock);
+
+  pthread_mutex_unlock(&gate_lock);
+}
+
+/**
+ * Closes the fds of the shard's scheduler, once it won't run anymore.
+ */
+static void grn_shard_close() {
+  grn_sys_close(STATE.inbox_fd);
+  grn_sys_close(STATE.epfd);
+  STATE.inbox_fd = -1;
+}
+
+/**
+ * Body of a shard's kernel thread: runs the shard's function on a fresh
+ * scheduler, then keeps running work other shards submit until every shard's
+ * function has returned.
+ */
+static void *grn_shard_main(void *arg) {
+  grn_shard *shard = arg;
+
+  grn_shard_pin(shard->id);
+
+  STATE.shard = shard;
+  grn_init(shard_preempt);
+  // Submitters that see accepting see the state it was set up in
+  shard->state = &STATE;
+  __atomic_store_n(&shard->accepting, true, __ATOMIC_RELEASE);
+
+  if (!grn_shard_gate()) {
+    __atomic_store_n(&shard->accepting, false, __ATOMIC_RELEASE);
+    grn_shard_close();
+    return NULL;
+  }
+
+  shard_fn(shard_arg);
+  grn_wait();
+
+  if (__atomic_sub_fetch(&shards_running, 1, __ATOMIC_ACQ_REL) == 0) {
+    for (int i = 0; i < shard_count; i++) grn_wake(&shards[i].stopped);
+  }
+
+  grn_park(&shard->stopped);
+  grn_wait();
+
+  // Once nobody is in the middle of submitting, whatever was submitted is in
+  // the inbox and the last grn_wait() picks it up
+  __atomic_store_n(&shard->accepting, false, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&shard->submitters, __ATOMIC_SEQ_CST) > 0) sched_yield();
+  grn_wait();
+
+  // A worker finishing an offloaded call wakes its thread through our inbox
+  while (STATE.offload_jobs > 0) grn_park(&STATE.offload_idle);
+  grn_wait();
+
+  grn_shard_barrier();
+  grn_shard_close();
+  return NULL;
+}
+
+/**
+ * Runs `fn(arg)` on each of `count` shards and waits for them to finish.
+ *
+ * A shard is a scheduler of its own on a kernel thread pinned to a CPU, as if
+ * grn_init() had been called on each of them. Shards share no run queues,
+ * epoll set or timers, so they scale with the number of cores without any
+ * cache lines bouncing between them. A server would typically open its own
+ * listener on each shard with grn_listen_reuseport() and let the kernel spread
+ * the connections. Anything the shards need to exchange goes through
+ * grn_shard_submit().
+ *
+ * `fn` runs as the initial thread of every shard, grn_shard_id() tells which
+ * one it's on. A shard stops once `fn` has returned on every shard and its
+ * READY threads have finished. Threads still parked at that point are
+ * abandoned, but the shards first wait for the grn_offload() calls of their
+ * threads to return and for each other to stop, so no wake from a worker or
+ * another shard is left to go to a shard that's gone. Kernel threads of the
+ * application must not grn_wake() a shard's threads after it stopped.
+ *
+ * @param count the number of shards, 0 for one per CPU the process may run on
+ * @param preempt true if the shards' schedulers should preempt
+ * @param fn the function to run on every shard
+ * @param arg the argument to pass to `fn`
+ *
+ * @return 0 once every shard has stopped, -1 with errno set to EBUSY if shards
+ *         are already running, or as set by pthread_create() if a shard
+ *         couldn't be started, in which case none of them runs `fn`
+ */
+int grn_shard_run(int count, bool preempt, grn_fn fn, void *arg) {
+  if (count <= 0) {
+    cpu_set_t allowed;
+    count = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+  }
+
+  pthread_mutex_lock(&gate_lock);
+  if (shards != NULL) {
+    pthread_mutex_unlock(&gate_lock);
+    errno = EBUSY;
+    return -1;
+  }
+
+  shards = calloc(count, sizeof(grn_shard));
+  assert_malloc(shards);
+  shard_count = count;
+  shards_running = count;
+  shard_fn = fn;
+  shard_arg = arg;
+  shard_preempt = preempt;
+  gate = GRN_SHARD_STARTING;
+  shards_ready = 0;
+  shards_stopped = 0;
+  pthread_mutex_unlock(&gate_lock);
+
+  int started = 0;
+  int err = 0;
+  for (; started < count; started++) {
+    shards[started].id = started;
+    grn_waker_init(&shards[started].stopped);
+
+    err = pthread_create(&shards[started].thread, NULL, grn_shard_main, &shards[started]);
+    if (err != 0) break;
+  }
+
+  pthread_mutex_lock(&gate_lock);
+  while (shards_ready < started) pthread_cond_wait(&gate_cond, &gate_lock);
+  gate = err == 0 ? GRN_SHARD_GO : GRN_SHARD_ABORT;
+  pthread_cond_broadcast(&gate_cond);
+  pthread_mutex_unlock(&gate_lock);
+
+  for (int i = 0; i < started; i++) pthread_join(shards[i].thread, NULL);
+
+  pthread_mutex_lock(&gate_lock);
+  free(shards);
+  shards = NULL;
+  shard_count = 0;
+  pthread_mutex_unlock(&gate_lock);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @return the index of the shard the caller runs on, -1 outside of a shard
+ */
+int grn_shard_id() {
+  return STATE.shard != NULL ? STATE.shard->id : -1;
+}
+
+/**
+ * @return the number of shards of the current grn_shard_run(), 0 if none is
+ *         running
+ */
+int grn_shard_count() {
+  return shard_count;
+}
+
+/**
+ * Sends work to another shard: starts a detached green thread running
+ * `fn(arg)` on shard `id`. The thread is created the next time that shard
+ * checks for events. This is the only way shards talk to each other, so `arg`
+ * is the message and belongs to the receiving side from now on. Safe to call
+ * from any kernel thread while grn_shard_run() is running.
+ *
+ * @param id the index of the shard to run `fn` on
+ * @param fn the function to run
+ * @param arg the argument to pass to `fn`
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if there's no shard `id`,
+ *         or ESHUTDOWN if it has stopped taking work
+ */
+int grn_shard_submit(int id, grn_fn fn, void *arg) {
+  if (id < 0 || id >= shard_count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  grn_shard *shard = &shards[id];
+
+  __atomic_add_fetch(&shard->submitters, 1, __ATOMIC_SEQ_CST);
+  // Either the shard sees us in submitters, or we see it stopped accepting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  int ret;
+  if (__atomic_load_n(&shard->accepting, __ATOMIC_ACQUIRE)) {
+    ret = grn_inbox_spawn_on(shard->state, fn, arg);
+  } else {
+    errno = ESHUTDOWN;
+    ret = -1;
+  }
+
+  __atomic_sub_fetch(&shard->submitters, 1, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+/**
+ * Opens a listening TCP socket on `addr` with SO_REUSEPORT set, so every shard
+ * can listen on the same address and the kernel spreads incoming connections
+ * across them. The socket is nonblocking and close-on-exec, ready for
+ * grn_listen_serve() or grn_accept().
+ *
+ * @param addr the address to bind to
+ * @param addrlen the size of `addr`
+ * @param backlog the listen() backlog
+ *
+ * @return the listening socket, or -1 with errno set
+ */
+int grn_listen_reuseport(const struct sockaddr *addr, socklen_t addrlen, int backlog) {
+  int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+      bind(fd, addr, addrlen) == -1 || listen(fd, backlog) == -1) {
+    int saved_errno = errno;
+    grn_sys_close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  return fd;
+}
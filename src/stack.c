@@ -0,0 +1,140 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * The byte painted over fresh stacks. Any 8-byte word that no longer holds
+ * the pattern was written by the thread at some point.
+ */
+#define STACK_PAINT 0xcd
+#define STACK_PAINT_WORD 0xcdcdcdcdcdcdcdcdULL
+
+/*
+ * High-water marks are kept in a fixed size histogram, 1KB per bucket with the
+ * default STACK_SIZE, which is enough resolution to pick a stack size.
+ */
+#define STACK_BUCKETS 1024
+#define STACK_BUCKET_SIZE (STACK_SIZE / STACK_BUCKETS)
+
+static uint64_t histogram[STACK_BUCKETS];
+static uint64_t recorded_count = 0;
+static size_t recorded_max = 0;
+static bool report_registered = false;
+
+static void grn_stack_report_at_exit() {
+  grn_stack_report(stderr);
+}
+
+/**
+ * Enables or disables stack painting for threads created afterwards. Painting
+ * fills each new stack with a pattern so grn_stack_usage() can tell how deep
+ * it has ever been used. The first time painting is enabled, a report of the
+ * recorded high-water marks is scheduled to print to stderr at exit.
+ *
+ * Painting touches every page of every stack, so a process measured this way
+ * uses the full STACK_SIZE of memory per thread. It's meant for sizing stacks,
+ * not for production.
+ *
+ * @param enable true to paint new stacks, false to stop
+ */
+void grn_stack_paint(bool enable) {
+  STATE.paint_stacks = enable;
+
+  if (enable && !report_registered) {
+    report_registered = true;
+    atexit(grn_stack_report_at_exit);
+  }
+}
+
+/**
+ * Paints the whole stack of `thread` with the paint pattern.
+ *
+ * @param thread a thread with an allocated stack
+ */
+void grn_stack_fill(grn_thread *thread) {
+  memset(thread->stack, STACK_PAINT, STACK_SIZE);
+  thread->painted = true;
+}
+
+/**
+ * Returns the peak number of bytes `thread` has used of its stack so far.
+ *
+ * The stack grows down, so this scans up from the lowest address for the first
+ * word that was overwritten. It's O(unused stack) and intended for diagnostics.
+ *
+ * @param thread the thread to measure
+ *
+ * @return the high-water mark in bytes, or 0 if the stack wasn't painted
+ */
+size_t grn_stack_usage(grn_thread *thread) {
+  if (thread == NULL || !thread->painted) return 0;
+
+  uint64_t *words = (uint64_t *)thread->stack;
+  size_t count = STACK_SIZE / sizeof(uint64_t);
+  size_t i = 0;
+
+  while (i < count && words[i] == STACK_PAINT_WORD) {
+    i++;
+  }
+
+  return (count - i) * sizeof(uint64_t);
+}
+
+/**
+ * Adds the high-water mark of an exiting thread to the aggregate statistics.
+ *
+ * @param thread the exiting thread, its stack must still be allocated
+ */
+void grn_stack_record(grn_thread *thread) {
+  size_t usage = grn_stack_usage(thread);
+  size_t bucket = usage / STACK_BUCKET_SIZE;
+
+  if (bucket >= STACK_BUCKETS) bucket = STACK_BUCKETS - 1;
+
+  histogram[bucket]++;
+  recorded_count++;
+  if (usage > recorded_max) recorded_max = usage;
+}
+
+/**
+ * Returns the smallest bucket bound that covers `percent` of the recorded
+ * threads.
+ */
+static size_t stack_percentile(unsigned percent) {
+  uint64_t target = (recorded_count * percent + 99) / 100;
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < STACK_BUCKETS; i++) {
+    seen += histogram[i];
+    if (seen >= target) return (i + 1) * STACK_BUCKET_SIZE;
+  }
+
+  return STACK_SIZE;
+}
+
+/**
+ * Prints the stack high-water marks of every painted thread that has exited
+ * so far: p50, p90, p99 (rounded up to the next bucket) and the exact maximum.
+ *
+ * @param out the stream to write the report to
+ */
+void grn_stack_report(FILE *out) {
+  if (recorded_count == 0) {
+    fprintf(out, "chloros stack usage: no painted threads have exited\n");
+    return;
+  }
+
+  fprintf(out,
+          "chloros stack usage over %" PRIu64 " threads: p50 %zuKB, p90 %zuKB, "
+          "p99 %zuKB, max %zu bytes of %" PRIu64 "\n",
+          recorded_count, stack_percentile(50) / 1024, stack_percentile(90) / 1024,
+          stack_percentile(99) / 1024, recorded_max, STACK_SIZE);
+}
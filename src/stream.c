@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "utils.h"
+
+/*
+ * A buffered stream over an fd. Reads are buffered in `rbuf`, whose unread
+ * bytes are [rstart, rend), and compacted to the front when more room is
+ * needed so that views handed out stay contiguous. Writes are coalesced in
+ * `wbuf` until it fills, the stream reads, or it's flushed.
+ */
+struct grn_stream_struct {
+  int fd;
+
+  char *rbuf;
+  size_t rstart;
+  size_t rend;
+  bool eof;
+
+  char *wbuf;
+  size_t wlen;
+};
+
+/**
+ * Takes a buffer from the pool, or allocates one if the pool is empty.
+ */
+static char *grn_stream_buffer_get() {
+  char *buf = NULL;
+
+  grn_preempt_disable();
+  if (STATE.stream_buffer_count > 0) {
+    buf = STATE.stream_buffers[--STATE.stream_buffer_count];
+  }
+  grn_preempt_enable();
+
+  if (buf == NULL) {
+    buf = malloc(GRN_STREAM_BUFFER_SIZE);
+    assert_malloc(buf);
+  }
+
+  return buf;
+}
+
+/**
+ * Gives a buffer back to the pool, freeing it if the pool is full.
+ */
+static void grn_stream_buffer_put(char *buf) {
+  if (buf == NULL) return;
+
+  grn_preempt_disable();
+  if (STATE.stream_buffer_count < STREAM_POOL_SIZE) {
+    STATE.stream_buffers[STATE.stream_buffer_count++] = buf;
+    buf = NULL;
+  }
+  grn_preempt_enable();
+
+  free(buf);
+}
+
+/**
+ * Creates a buffered stream over `fd`. Buffers are taken from a shared pool
+ * the first time the stream reads or writes.
+ *
+ * @param fd the fd to wrap, owned by the stream from now on
+ *
+ * @return the new stream
+ */
+grn_stream *grn_stream_open(int fd) {
+  grn_stream *stream = calloc(1, sizeof(grn_stream));
+  assert_malloc(stream);
+  stream->fd = fd;
+
+  return stream;
+}
+
+/**
+ * Flushes the stream, returns its buffers to the pool, closes its fd and frees
+ * it.
+ *
+ * @return 0 on success, -1 if the flush or close failed, the stream is freed
+ *         either way
+ */
+int grn_stream_close(grn_stream *stream) {
+  int ret = grn_stream_flush(stream);
+
+  grn_stream_buffer_put(stream->rbuf);
+  grn_stream_buffer_put(stream->wbuf);
+
+  if (grn_close(stream->fd) == -1) ret = -1;
+  free(stream);
+
+  return ret;
+}
+
+/**
+ * Writes out all of `iov`, parking as needed.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int grn_stream_writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = grn_writev(fd, iov, iovcnt);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    // Skip past the parts that were written
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Writes out the data coalesced by grn_stream_write().
+ *
+ * @return 0 on success, -1 on error
+ */
+int grn_stream_flush(grn_stream *stream) {
+  if (stream->wlen == 0) return 0;
+
+  struct iovec iov = {stream->wbuf, stream->wlen};
+  stream->wlen = 0;
+
+  return grn_stream_writev_all(stream->fd, &iov, 1);
+}
+
+/**
+ * Queues `count` bytes for writing. Small writes are copied into the write
+ * buffer and sent together once it fills, the stream reads, or it's flushed.
+ * A write that doesn't fit goes out immediately together with what's
+ * buffered, in one writev().
+ *
+ * @return `count`, or -1 on error
+ */
+ssize_t grn_stream_write(grn_stream *stream, const void *buf, size_t count) {
+  if (stream->wbuf == NULL) stream->wbuf = grn_stream_buffer_get();
+
+  if (stream->wlen + count < GRN_STREAM_BUFFER_SIZE) {
+    memcpy(stream->wbuf + stream->wlen, buf, count);
+    stream->wlen += count;
+    return count;
+  }
+
+  struct iovec iov[2] = {{stream->wbuf, stream->wlen}, {(void *)buf, count}};
+  stream->wlen = 0;
+
+  if (grn_stream_writev_all(stream->fd, iov, 2) == -1) return -1;
+  return count;
+}
+
+/**
+ * Reads more data into the read buffer. Anything waiting to be written is
+ * flushed first, since the peer is likely waiting for it before it replies.
+ *
+ * @return the number of bytes read, 0 at end of file or if the buffer is full,
+ *         -1 on error
+ */
+static ssize_t grn_stream_fill(grn_stream *stream) {
+  if (grn_stream_flush(stream) == -1) return -1;
+
+  if (stream->rbuf == NULL) stream->rbuf = grn_stream_buffer_get();
+
+  // Move the unread bytes to the front to make room
+  if (stream->rstart > 0) {
+    memmove(stream->rbuf, stream->rbuf + stream->rstart, stream->rend - stream->rstart);
+    stream->rend -= stream->rstart;
+    stream->rstart = 0;
+  }
+
+  size_t room = GRN_STREAM_BUFFER_SIZE - stream->rend;
+  if (room == 0 || stream->eof) return 0;
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = grn_read(stream->fd, stream->rbuf + stream->rend, room);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  if (bytes_read == 0) stream->eof = true;
+  if (bytes_read > 0) stream->rend += bytes_read;
+
+  return bytes_read;
+}
+
+/**
+ * Returns a view of the next bytes of the stream without consuming them,
+ * reading until at least `count` bytes are buffered or the end of the stream.
+ * The view stays valid until the next call on the stream.
+ *
+ * @param count the number of bytes wanted, at most GRN_STREAM_BUFFER_SIZE
+ * @param[out] view set to the start of the buffered bytes
+ *
+ * @return the number of bytes buffered, which is less than `count` only at
+ *         the end of the stream, or -1 on error
+ */
+ssize_t grn_stream_peek(grn_stream *stream, size_t count, const char **view) {
+  if (count > GRN_STREAM_BUFFER_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  while (stream->rend - stream->rstart < count) {
+    ssize_t bytes_read = grn_stream_fill(stream);
+    if (bytes_read == -1) return -1;
+    if (bytes_read == 0) break;
+  }
+
+  *view = stream->rbuf != NULL ? stream->rbuf + stream->rstart : NULL;
+  return stream->rend - stream->rstart;
+}
+
+/**
+ * Consumes exactly `count` bytes of the stream and returns a view of them.
+ * The view stays valid until the next call on the stream.
+ *
+ * @param count the number of bytes to read, at most GRN_STREAM_BUFFER_SIZE
+ * @param[out] view set to the start of the bytes
+ *
+ * @return `count`, 0 if the stream ended first (the bytes that were there are
+ *         left unconsumed), or -1 on error
+ */
+ssize_t grn_stream_read_exact(grn_stream *stream, size_t count, const char **view) {
+  ssize_t available = grn_stream_peek(stream, count, view);
+  if (available == -1) return -1;
+  if ((size_t)available < count) return 0;
+
+  stream->rstart += count;
+  return count;
+}
+
+/**
+ * Consumes the stream up to and including the next `delim` byte and returns a
+ * view of it. The view stays valid until the next call on the stream.
+ *
+ * @param delim the byte to stop at, e.g. '\n'
+ * @param[out] view set to the start of the bytes
+ *
+ * @return the length including `delim`, 0 if the stream ended first, or -1 on
+ *         error. Fails with ENOBUFS if no `delim` fits in the buffer.
+ */
+ssize_t grn_stream_read_until(grn_stream *stream, char delim, const char **view) {
+  size_t scanned = 0;
+
+  for (;;) {
+    if (stream->rbuf != NULL) {
+      char *start = stream->rbuf + stream->rstart;
+      size_t available = stream->rend - stream->rstart;
+      char *found = memchr(start + scanned, delim, available - scanned);
+
+      if (found != NULL) {
+        size_t length = found - start + 1;
+        *view = start;
+        stream->rstart += length;
+        return length;
+      }
+
+      scanned = available;
+    }
+
+    ssize_t bytes_read = grn_stream_fill(stream);
+    if (bytes_read == -1) return -1;
+    if (bytes_read == 0) {
+      if (stream->eof) return 0;
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+}
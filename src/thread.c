@@ -25,9 +25,9 @@
  * previously returned number
  */
 int64_t atomic_next_id() {
-  // TODO: Make atomic if multiplexing green threads onto OS threads.
+  // Shards create threads concurrently, IDs stay unique across all of them
   static int64_t number = 0;
-  return number++;
+  return __atomic_fetch_add(&number, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -84,6 +84,7 @@ void add_joinable_thread(grn_thread *thread) {
  * @param thread: the thread being moved from active_threads to waiting_threads
  */
 void move_thread_to_waiting(grn_thread *thread) {
+  grn_rq_block(thread);
   thread->status = WAITING;
   remove_thread(thread);
   add_waiting_thread(thread);
@@ -93,6 +94,7 @@ void move_thread_to_active(grn_thread *thread) {
   thread->status = READY;
   remove_waiting_thread(thread);
   add_thread(thread);
+  grn_rq_wake(thread);
 }
 
 void move_thread_to_joinable(grn_thread *thread) {
@@ -101,6 +103,90 @@ void move_thread_to_joinable(grn_thread *thread) {
   add_joinable_thread(thread);
 }
 
+/**
+ * Makes a WAITING `thread` runnable again. A thread that is woken while it is
+ * still inside grn_yield on its way to parking (i.e. it is STATE.current) is
+ * simply marked RUNNING, so grn_yield treats it like any other yield. Threads
+ * that aren't WAITING were already woken by some other event and are left
+ * alone.
+ *
+ * @param thread the thread to wake; must be non-null
+ */
+void grn_wake_thread(grn_thread *thread) {
+  assert(thread);
+  if (thread->status != WAITING) return;
+
+  if (thread == STATE.current) {
+    thread->status = RUNNING;
+  } else {
+    move_thread_to_active(thread);
+  }
+}
+
+/**
+ * Appends `waiter` to the tail of `queue`.
+ *
+ * @param queue the queue to add to
+ * @param waiter a waiter that isn't in any queue
+ */
+void grn_waitq_push(grn_waitq *queue, grn_waiter *waiter) {
+  waiter->queue = queue;
+  waiter->next = NULL;
+  waiter->prev = queue->tail;
+
+  if (queue->tail) {
+    queue->tail->next = waiter;
+  } else {
+    queue->head = waiter;
+  }
+  queue->tail = waiter;
+}
+
+/**
+ * Unlinks `waiter` from the queue it is in, if any.
+ *
+ * @param waiter the waiter to remove
+ */
+void grn_waitq_remove(grn_waiter *waiter) {
+  grn_waitq *queue = waiter->queue;
+  if (queue == NULL) return;
+
+  if (waiter->prev) {
+    waiter->prev->next = waiter->next;
+  } else {
+    queue->head = waiter->next;
+  }
+
+  if (waiter->next) {
+    waiter->next->prev = waiter->prev;
+  } else {
+    queue->tail = waiter->prev;
+  }
+
+  waiter->queue = NULL;
+  waiter->prev = waiter->next = NULL;
+}
+
+/**
+ * Removes the waiter at the head of `queue`, records `revents` on it and wakes
+ * its thread.
+ *
+ * @param queue the queue to wake from
+ * @param revents the events to report to the waiter
+ *
+ * @return the woken waiter, or NULL if the queue was empty
+ */
+grn_waiter *grn_waitq_wake_one(grn_waitq *queue, uint32_t revents) {
+  grn_waiter *waiter = queue->head;
+  if (waiter == NULL) return NULL;
+
+  grn_waitq_remove(waiter);
+  waiter->revents |= revents;
+  grn_wake_thread(waiter->thread);
+
+  return waiter;
+}
+
 /**
  * Removes the `thread` to the linked list headed by STATE.active_threads.
  * Panics if the pointer to the thread being removed is NULL.
@@ -175,7 +261,10 @@ grn_thread *next_waiting_thread(grn_thread *thread) {
  * to a unique number, sets its status to WAITING, and adds the thread to the
  * linked list headed by STATE.threads. If `alloc_stack` is true, a 16-byte
  * aligned memory region of size `STACK_SIZE` is allocated, and a pointer to the
- * region is stored in the thread's `stack` property.
+ * region is stored in the thread's `stack` property. If stack painting is
+ * enabled, the stack is filled with a known pattern so its high-water mark can
+ * later be measured. The thread isn't queued to run until whoever makes it
+ * READY passes it to grn_rq_enqueue().
  *
  * @param alloc_stack whether or not to allocate a stack for the thread
  *
@@ -185,10 +274,16 @@ grn_thread *grn_new_thread(bool alloc_stack) {
   grn_thread *new_thread = calloc(sizeof(grn_thread), 1);
 
   new_thread->id = atomic_next_id();
+  new_thread->budget = STATE.coop_budget;
+  new_thread->priority = GRN_PRIO_DEFAULT;
 
   if (alloc_stack) {
     int allocated = posix_memalign((void **)&new_thread->stack, 16, STACK_SIZE);
     assert(allocated == 0);
+
+    if (STATE.paint_stacks) {
+      grn_stack_fill(new_thread);
+    }
   }
 
   add_thread(new_thread);
@@ -204,6 +299,7 @@ grn_thread *grn_new_thread(bool alloc_stack) {
  */
 void grn_destroy_thread(grn_thread *thread) {
   remove_thread(thread);
+  grn_rq_remove(thread);
 
   if (thread->stack != NULL) {
     free(thread->stack);
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "thread.h"
+#include "timer.h"
+#include "utils.h"
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t grn_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Arms `timer` to wake the current thread at `deadline`. The thread still has
+ * to park itself (mark itself WAITING and yield).
+ *
+ * @param timer an unarmed timer
+ * @param deadline the CLOCK_MONOTONIC time in nanoseconds to fire at
+ */
+void grn_timer_add(grn_timer *timer, uint64_t deadline) {
+  timer->deadline = deadline;
+  timer->thread = STATE.current;
+  timer->armed = true;
+  timer->fired = false;
+
+  // Timers are few and mostly added with similar timeouts, so a sorted list
+  // searched from the back is plenty
+  grn_timer *prev = STATE.timers_tail;
+  while (prev != NULL && prev->deadline > deadline) {
+    prev = prev->prev;
+  }
+
+  timer->prev = prev;
+  timer->next = prev ? prev->next : STATE.timers;
+
+  if (timer->next) {
+    timer->next->prev = timer;
+  } else {
+    STATE.timers_tail = timer;
+  }
+
+  if (prev) {
+    prev->next = timer;
+  } else {
+    STATE.timers = timer;
+  }
+}
+
+/**
+ * Disarms `timer` if it hasn't fired yet.
+ *
+ * @param timer the timer to remove
+ */
+void grn_timer_remove(grn_timer *timer) {
+  if (!timer->armed) return;
+
+  if (timer->prev) {
+    timer->prev->next = timer->next;
+  } else {
+    STATE.timers = timer->next;
+  }
+
+  if (timer->next) {
+    timer->next->prev = timer->prev;
+  } else {
+    STATE.timers_tail = timer->prev;
+  }
+
+  timer->armed = false;
+  timer->prev = timer->next = NULL;
+}
+
+/**
+ * Shortens an epoll_wait() timeout so the wait ends by the earliest deadline.
+ *
+ * @param timeout the timeout in milliseconds, -1 for none
+ *
+ * @return the timeout in milliseconds to pass to epoll_wait()
+ */
+int grn_timer_timeout(int timeout) {
+  if (STATE.timers == NULL || timeout == 0) return timeout;
+
+  uint64_t now = grn_now();
+  if (STATE.timers->deadline <= now) return 0;
+
+  // Round up, waking before the deadline would just mean waiting again
+  uint64_t until = (STATE.timers->deadline - now + 999999) / 1000000;
+  if (until > INT32_MAX) until = INT32_MAX;
+
+  if (timeout < 0 || (uint64_t)timeout > until) return (int)until;
+  return timeout;
+}
+
+/**
+ * nanosleep() for green threads, parks the current thread for the requested
+ * time instead of blocking the process. Nothing interrupts the sleep, so
+ * `rem` is always set to zero.
+ *
+ * @return 0, or -1 with errno set to EINVAL if `req` is out of range
+ */
+int grn_nanosleep(const struct timespec *req, struct timespec *rem) {
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uint64_t deadline = grn_now() + (uint64_t)req->tv_sec * 1000000000ULL + req->tv_nsec;
+
+  grn_preempt_disable();
+
+  grn_timer timer = {0};
+  grn_timer_add(&timer, deadline);
+
+  while (!timer.fired) {
+    STATE.current->status = WAITING;
+    grn_yield();
+  }
+
+  grn_preempt_enable();
+
+  if (rem != NULL) {
+    rem->tv_sec = 0;
+    rem->tv_nsec = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Wakes the threads of every timer whose deadline has passed, or runs their
+ * `on_fire` callbacks.
+ */
+void grn_timer_fire() {
+  if (STATE.timers == NULL) return;
+
+  uint64_t now = grn_now();
+  while (STATE.timers != NULL && STATE.timers->deadline <= now) {
+    grn_timer *timer = STATE.timers;
+    grn_timer_remove(timer);
+    timer->fired = true;
+    if (timer->on_fire != NULL) {
+      timer->on_fire(timer->on_fire_arg);
+    } else {
+      grn_wake_thread(timer->thread);
+    }
+  }
+}
@@ -0,0 +1,142 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "thread.h"
+#include "utils.h"
+
+/*
+ * Waiting for a known set of threads instead of for everything, as grn_wait()
+ * does. Waiters park on the waitgroup rather than yielding in a loop, and the
+ * last grn_waitgroup_done() wakes them all. Waitgroups and scopes belong to
+ * the scheduler they're used on, they can't be shared between shards.
+ */
+
+/**
+ * Initializes `wg` with a count of 0.
+ */
+void grn_waitgroup_init(grn_waitgroup *wg) {
+  wg->count = 0;
+  wg->generation = 0;
+  wg->waiters = NULL;
+}
+
+/**
+ * Adds `delta`, which may be negative, to the count of `wg`. Waiters are woken
+ * when it gets to 0. Exits the program if the count goes negative.
+ *
+ * @param wg the waitgroup
+ * @param delta what to add to the count
+ */
+void grn_waitgroup_add(grn_waitgroup *wg, int delta) {
+  grn_preempt_disable();
+
+  wg->count += delta;
+  if (wg->count < 0) err_exit("grn_waitgroup_add: negative waitgroup count\n");
+
+  if (wg->count == 0) {
+    // Waiters tell their round apart by the generation, so the count can go
+    // up again before they get to run
+    wg->generation++;
+
+    grn_thread *waiter = wg->waiters;
+    wg->waiters = NULL;
+    while (waiter != NULL) {
+      grn_thread *next = waiter->wg_next;
+      waiter->wg_next = NULL;
+      grn_wake_thread(waiter);
+      waiter = next;
+    }
+  }
+
+  grn_preempt_enable();
+}
+
+/**
+ * Takes one off the count of `wg`, same as grn_waitgroup_add(wg, -1).
+ */
+void grn_waitgroup_done(grn_waitgroup *wg) {
+  grn_waitgroup_add(wg, -1);
+}
+
+/**
+ * Parks the current thread until the count of `wg` gets to 0. Returns right
+ * away if it's 0 already.
+ *
+ * @param wg the waitgroup to wait on
+ */
+void grn_waitgroup_wait(grn_waitgroup *wg) {
+  grn_preempt_disable();
+
+  if (wg->count > 0) {
+    uint64_t generation = wg->generation;
+
+    STATE.current->wg_next = wg->waiters;
+    wg->waiters = STATE.current;
+
+    while (wg->generation == generation) {
+      STATE.current->status = WAITING;
+      grn_yield();
+    }
+  }
+
+  grn_preempt_enable();
+}
+
+/**
+ * Initializes an empty scope.
+ */
+void grn_scope_init(grn_scope *scope) {
+  grn_waitgroup_init(&scope->wg);
+}
+
+/**
+ * Exit hook of the threads of a scope, runs with preemption disabled.
+ */
+static void grn_scope_thread_exit(void *arg) {
+  grn_scope *scope = arg;
+  grn_waitgroup_done(&scope->wg);
+}
+
+/**
+ * Spawns a thread running `fn(arg)` that belongs to `scope`, at the priority
+ * and in the group of the current thread, and yields to it like grn_spawn().
+ * The thread is detached: it can't be joined, it's waited for with
+ * grn_scope_wait() and its return value is discarded.
+ *
+ * @param scope the scope the thread belongs to
+ * @param fn the function to run
+ * @param arg the argument to pass to `fn`
+ *
+ * @return the ID of the new thread
+ */
+int grn_scope_spawn(grn_scope *scope, grn_fn fn, void *arg) {
+  grn_preempt_disable();
+
+  grn_thread *thread = grn_create(fn, arg, STATE.current->priority, STATE.current->group);
+  thread->detached = true;
+  thread->on_exit = grn_scope_thread_exit;
+  thread->on_exit_arg = scope;
+  grn_waitgroup_add(&scope->wg, 1);
+
+  grn_preempt_enable();
+
+  return grn_start(thread);
+}
+
+/**
+ * Ends `scope`: parks until every thread spawned in it has exited, then frees
+ * their stacks right away rather than on a later yield. The scope is empty
+ * afterwards and can be reused.
+ *
+ * @param scope the scope to wait for
+ */
+void grn_scope_wait(grn_scope *scope) {
+  grn_waitgroup_wait(&scope->wg);
+
+  grn_preempt_disable();
+  grn_gc();
+  grn_preempt_enable();
+}
@@ -168,5 +168,16 @@ void phase5_tests(bool *result, int *_num_tests, int *_num_passed);
 void phase6_tests(bool *result, int *_num_tests, int *_num_passed);
 void argument_tests(bool *result, int *_num_tests, int *_num_passed);
 void join_tests(bool *result, int *_num_tests, int *_num_passed);
+void profile_tests(bool *result, int *_num_tests, int *_num_passed);
+void stack_tests(bool *result, int *_num_tests, int *_num_passed);
+void io_tests(bool *result, int *_num_tests, int *_num_passed);
+void stream_tests(bool *result, int *_num_tests, int *_num_passed);
+void inbox_tests(bool *result, int *_num_tests, int *_num_passed);
+void sched_tests(bool *result, int *_num_tests, int *_num_passed);
+void shard_tests(bool *result, int *_num_tests, int *_num_passed);
+void waitgroup_tests(bool *result, int *_num_tests, int *_num_passed);
+void future_tests(bool *result, int *_num_tests, int *_num_passed);
+void coro_tests(bool *result, int *_num_tests, int *_num_passed);
+void preload_tests(bool *result, int *_num_tests, int *_num_passed);
 
 #endif
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chloros.h"
+#include "test.h"
+
+static void *fibonacci(void *arg) {
+  long count = (long)arg;
+  long a = 0, b = 1;
+
+  for (long i = 0; i < count; i++) {
+    grn_coro_yield((void *)a);
+    long next = a + b;
+    a = b;
+    b = next;
+  }
+
+  return (void *)-1L;
+}
+
+static bool generator_test() {
+  grn_init(false);
+
+  long expected[] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34};
+  grn_coro *fib = grn_coro_create(fibonacci, (void *)10L);
+
+  for (int i = 0; i < 10; i++) {
+    check_eq((long)grn_coro_resume(fib, NULL), expected[i]);
+    check(!grn_coro_done(fib));
+  }
+
+  // The body's return value comes out of the last resume
+  check_eq((long)grn_coro_resume(fib, NULL), -1);
+  check(grn_coro_done(fib));
+  check_eq(grn_coro_resume(fib, NULL), NULL);
+  check_eq(errno, EINVAL);
+
+  grn_coro_destroy(fib);
+
+  // Not in a coroutine
+  check_eq(grn_coro_yield(NULL), NULL);
+  check_eq(errno, EPERM);
+  return true;
+}
+
+static void *running_sum(void *arg) {
+  (void)arg;
+  long sum = 0;
+  long value = 0;
+
+  // Each resume sends a number in and gets the sum so far back
+  for (;;) {
+    sum += value;
+    value = (long)grn_coro_yield((void *)sum);
+    if (value == 0) return (void *)sum;
+  }
+}
+
+static void *outer(void *arg) {
+  grn_coro *inner = arg;
+
+  // Yields from inner go back to us, not to the main thread
+  for (long i = 1; i <= 3; i++) grn_coro_resume(inner, (void *)i);
+  grn_coro_yield((void *)grn_coro_resume(inner, NULL));
+  return NULL;
+}
+
+static bool nested_test() {
+  grn_init(false);
+
+  grn_coro *inner = grn_coro_create(running_sum, NULL);
+  grn_coro *outside = grn_coro_create(outer, inner);
+
+  grn_coro_resume(inner, NULL);
+  check_eq((long)grn_coro_resume(outside, NULL), 6);
+  check(grn_coro_done(inner));
+
+  grn_coro_destroy(inner);
+  grn_coro_destroy(outside);
+  return true;
+}
+
+static volatile int ticks = 0;
+
+static void *ticker(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 5; i++) {
+    ticks++;
+    grn_yield();
+  }
+  return NULL;
+}
+
+static void *sleepy(void *arg) {
+  (void)arg;
+  struct timespec req = {0, 10 * 1000 * 1000};
+
+  // Parks the thread that resumed us, the others keep running
+  grn_nanosleep(&req, NULL);
+  grn_coro_yield((void *)(long)ticks);
+  return NULL;
+}
+
+static bool park_in_coro_test() {
+  grn_init(false);
+  ticks = 0;
+
+  int64_t tid = grn_spawn(ticker, NULL);
+
+  grn_coro *coro = grn_coro_create(sleepy, NULL);
+  check(grn_coro_resume(coro, NULL) != NULL);
+  grn_join(tid, NULL);
+
+  // Destroyed before it finished, its stack is reused
+  grn_coro_destroy(coro);
+  coro = grn_coro_create(fibonacci, (void *)2L);
+  check_eq((long)grn_coro_resume(coro, NULL), 0);
+  grn_coro_destroy(coro);
+  return true;
+}
+
+static void *frame_chain_ends(void *arg) {
+  (void)arg;
+  // Our frame, then grn_coro_entry()'s, whose saved %rbp is the one the
+  // coroutine started with
+  uint64_t *fp = __builtin_frame_address(0);
+  uint64_t *entry_fp = (uint64_t *)fp[0];
+  return (void *)(long)(entry_fp[0] == 0);
+}
+
+static bool pooled_context_test() {
+  grn_init(false);
+
+  // Stopped in the middle, its saved registers point into its stack
+  grn_coro *coro = grn_coro_create(fibonacci, (void *)10L);
+  grn_coro_resume(coro, NULL);
+  grn_coro_destroy(coro);
+
+  // Gets the same stack and context from the pool, but starts clean
+  coro = grn_coro_create(frame_chain_ends, NULL);
+  check_eq((long)grn_coro_resume(coro, NULL), 1);
+  grn_coro_destroy(coro);
+  return true;
+}
+
+BEGIN_TEST_SUITE(coro_tests) {
+  run_test(generator_test);
+  run_test(nested_test);
+  run_test(park_in_coro_test);
+  run_test(pooled_context_test);
+}
@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chloros.h"
+#include "test.h"
+
+#define FAN_OUT 32
+
+static void sleep_ms(long ms) {
+  struct timespec req = {0, ms * 1000 * 1000};
+  grn_nanosleep(&req, NULL);
+}
+
+static void *square_later(void *arg) {
+  long n = (long)arg;
+  // Finish in a different order than they were started
+  sleep_ms((n * 7) % 11);
+  return (void *)(n * n);
+}
+
+static bool async_await_test() {
+  grn_init(false);
+
+  grn_future *future = grn_async(square_later, (void *)9L);
+  check_eq((long)grn_await(future), 81);
+  // Resolved futures return right away
+  check_eq((long)grn_await(future), 81);
+
+  grn_future_release(future);
+  return true;
+}
+
+static bool await_all_test() {
+  grn_init(false);
+
+  grn_future *futures[FAN_OUT];
+  for (long i = 0; i < FAN_OUT; i++) futures[i] = grn_async(square_later, (void *)i);
+
+  grn_await_all(futures, FAN_OUT);
+
+  for (long i = 0; i < FAN_OUT; i++) {
+    check_eq((long)grn_await(futures[i]), i * i);
+    grn_future_release(futures[i]);
+  }
+  return true;
+}
+
+static void *sleep_for(void *arg) {
+  sleep_ms((long)arg);
+  return arg;
+}
+
+static bool await_any_test() {
+  grn_init(false);
+
+  grn_future *futures[3] = {grn_async(sleep_for, (void *)60L), grn_async(sleep_for, (void *)5L),
+                            grn_async(sleep_for, (void *)30L)};
+
+  check_eq(grn_await_any(futures, 3), 1);
+  check_eq((long)grn_await(futures[1]), 5);
+
+  // The others still resolve, and we're no longer linked to them
+  grn_await_all(futures, 3);
+  check_eq(grn_await_any(futures, 3), 0);
+
+  for (int i = 0; i < 3; i++) grn_future_release(futures[i]);
+  return true;
+}
+
+static grn_future *promise;
+static volatile long awaited_sum = 0;
+
+static void *await_promise(void *arg) {
+  (void)arg;
+  awaited_sum += (long)grn_await(promise);
+  return NULL;
+}
+
+static bool promise_test() {
+  grn_init(false);
+  awaited_sum = 0;
+
+  promise = grn_future_create();
+  int64_t a = grn_spawn(await_promise, NULL);
+  int64_t b = grn_spawn(await_promise, NULL);
+
+  // Both awaiters are woken by the one resolution
+  check_eq(grn_future_resolve(promise, (void *)21L), 0);
+  check_eq(grn_future_resolve(promise, (void *)0L), -1);
+  grn_join(a, NULL);
+  grn_join(b, NULL);
+  check_eq(awaited_sum, 42);
+
+  grn_future_release(promise);
+  return true;
+}
+
+BEGIN_TEST_SUITE(future_tests) {
+  run_test(async_await_test);
+  run_test(await_all_test);
+  run_test(await_any_test);
+  run_test(promise_test);
+}
@@ -0,0 +1,81 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "test.h"
+
+#define EXTERNAL_SPAWNS 100
+
+static grn_waker done_waker;
+static volatile int spawned_runs = 0;
+
+static void *spawned(void *arg) {
+  (void)arg;
+  if (++spawned_runs == EXTERNAL_SPAWNS) grn_wake(&done_waker);
+  return NULL;
+}
+
+static void *spawn_from_pthread(void *arg) {
+  (void)arg;
+  for (int i = 0; i < EXTERNAL_SPAWNS; i++) {
+    if (grn_spawn_external(spawned, NULL) != 0) return (void *)-1L;
+  }
+  return NULL;
+}
+
+static bool spawn_external_test() {
+  grn_init(false);
+  grn_waker_init(&done_waker);
+
+  pthread_t producer;
+  check_eq(pthread_create(&producer, NULL, spawn_from_pthread, NULL), 0);
+
+  // Parks until the last of the spawned threads has run
+  grn_park(&done_waker);
+  check_eq(spawned_runs, EXTERNAL_SPAWNS);
+
+  void *ret;
+  pthread_join(producer, &ret);
+  check_eq(ret, NULL);
+  return true;
+}
+
+static void *wake_later(void *arg) {
+  usleep(20 * 1000);
+  grn_wake(arg);
+  return NULL;
+}
+
+static bool wake_test() {
+  grn_init(false);
+
+  grn_waker waker;
+  grn_waker_init(&waker);
+
+  pthread_t waker_thread;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  check_eq(pthread_create(&waker_thread, NULL, wake_later, &waker), 0);
+
+  // The scheduler has nothing else to run, it blocks in epoll until the kick
+  grn_park(&waker);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_join(waker_thread, NULL);
+
+  long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  check(elapsed_ms >= 20 && elapsed_ms < 500);
+
+  // A wake that comes first isn't lost
+  grn_wake(&waker);
+  grn_park(&waker);
+  return true;
+}
+
+BEGIN_TEST_SUITE(inbox_tests) {
+  run_test(spawn_external_test);
+  run_test(wake_test);
+}
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "test.h"
+
+static volatile int ticks = 0;
+static volatile bool writer_done = false;
+
+static void *ticker(void *arg) {
+  (void)arg;
+  while (!writer_done) {
+    ticks++;
+    grn_yield();
+  }
+
+  return NULL;
+}
+
+static void *hot_writer(void *arg) {
+  int fd = (int)(long)arg;
+  char byte = 'x';
+  int start = ticks;
+
+  // The socket buffer never fills up, so every write takes the fast path
+  for (int i = 0; i < 64; i++) {
+    grn_write(fd, &byte, 1);
+  }
+
+  int seen = ticks - start;
+  writer_done = true;
+  return (void *)(long)seen;
+}
+
+static bool run_hot_writer(uint32_t budget, long *ticks_seen) {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+  ticks = 0;
+  writer_done = false;
+
+  grn_init(false);
+  grn_set_coop_budget(budget);
+
+  int64_t tick_id = grn_spawn(ticker, NULL);
+  int64_t writer_id = grn_spawn(hot_writer, (void *)(long)fds[0]);
+
+  grn_join(writer_id, (void **)ticks_seen);
+  grn_join(tick_id, NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  return true;
+}
+
+static bool coop_budget_test() {
+  long seen = 0;
+
+  // Every 8 fast writes the writer has to let the ticker run
+  check(run_hot_writer(8, &seen));
+  check(seen >= 64 / 8 - 1);
+
+  return true;
+}
+
+static bool coop_budget_disabled_test() {
+  long seen = -1;
+
+  // Without a budget the writer monopolizes the scheduler
+  check(run_hot_writer(0, &seen));
+  check_eq(seen, 0);
+
+  return true;
+}
+
+static void *reader(void *arg) {
+  int fd = (int)(long)arg;
+  char buf[16] = {0};
+
+  ssize_t bytes_read = grn_read(fd, buf, sizeof(buf));
+  return (void *)bytes_read;
+}
+
+static void *writer(void *arg) {
+  int fd = (int)(long)arg;
+  return (void *)grn_write(fd, "ping", 4);
+}
+
+static bool full_duplex_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  grn_init(false);
+
+  // The reader parks on fds[0] first, then a second thread writes to it
+  int64_t reader_id = grn_spawn(reader, (void *)(long)fds[0]);
+  int64_t writer_id = grn_spawn(writer, (void *)(long)fds[0]);
+
+  long written = 0;
+  grn_join(writer_id, (void **)&written);
+  check_eq(written, 4);
+
+  char buf[4];
+  check_eq(read(fds[1], buf, 4), 4);
+  check_eq(write(fds[1], "pong!", 5), 5);
+
+  long bytes_read = 0;
+  grn_join(reader_id, (void **)&bytes_read);
+  check_eq(bytes_read, 5);
+
+  close(fds[0]);
+  close(fds[1]);
+  return true;
+}
+
+static bool regular_file_test() {
+  char path[] = "/tmp/chloros_io_testXXXXXX";
+  int fd = mkstemp(path);
+  check(fd >= 0);
+  unlink(path);
+
+  grn_init(false);
+
+  // epoll refuses regular files, the wrappers must not park on them
+  check_eq(grn_write(fd, "data", 4), 4);
+  check_eq(lseek(fd, 0, SEEK_SET), 0);
+
+  char buf[8] = {0};
+  check_eq(grn_read(fd, buf, sizeof(buf)), 4);
+  check_eq_str(buf, "data");
+
+  close(fd);
+  return true;
+}
+
+static void *delayed_writer(void *arg) {
+  struct timespec req = {0, 10 * 1000 * 1000};
+  grn_nanosleep(&req, NULL);
+  return (void *)grn_write((int)(long)arg, "ping", 4);
+}
+
+static bool fd_reuse_test() {
+  char path[] = "/tmp/chloros_io_testXXXXXX";
+  int fd = mkstemp(path);
+  check(fd >= 0);
+  unlink(path);
+
+  grn_init(false);
+
+  // The file's record says epoll refused the fd
+  char buf[8] = {0};
+  check_eq(grn_read(fd, buf, sizeof(buf)), 0);
+  close(fd);
+
+  // The reader gets the file's fd number, and must park on it rather than
+  // read it on the offload pool
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+  check_eq(fds[0], fd);
+
+  int64_t id = grn_spawn(delayed_writer, (void *)(long)fds[1]);
+  check_eq(grn_read(fds[0], buf, sizeof(buf)), 4);
+  grn_join(id, NULL);
+
+  // Same once grn_close() dropped the record, for a file after a socket
+  check_eq(grn_close(fds[0]), 0);
+  strcpy(path, "/tmp/chloros_io_testXXXXXX");
+  fd = mkstemp(path);
+  check_eq(fd, fds[0]);
+  unlink(path);
+  check_eq(grn_write(fd, "data", 4), 4);
+
+  close(fd);
+  close(fds[1]);
+  return true;
+}
+
+static bool fd_mode_reuse_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+  grn_init(false);
+
+  // Nonblocking, then closed behind the scheduler's back
+  check_eq(grn_write(fds[0], "ping", 4), 4);
+  close(fds[0]);
+  close(fds[1]);
+
+  // Blocking now: a read tried first would block the writer out
+  int old_fd = fds[0];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  check_eq(fds[0], old_fd);
+
+  char buf[8];
+  int64_t id = grn_spawn(delayed_writer, (void *)(long)fds[1]);
+  check_eq(grn_read(fds[0], buf, sizeof(buf)), 4);
+  grn_join(id, NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  return true;
+}
+
+static int closed_read_errno = 0;
+
+static void *closed_reader(void *arg) {
+  int fd = (int)(long)arg;
+  char buf[8];
+
+  ssize_t bytes_read = grn_read(fd, buf, sizeof(buf));
+  closed_read_errno = errno;
+  return (void *)bytes_read;
+}
+
+static bool close_reuse_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+  grn_init(false);
+
+  int64_t id = grn_spawn(closed_reader, (void *)(long)fds[0]);
+  grn_yield();
+
+  // The reader is woken by the close, and the number is reused for a socket
+  // with data on it before the reader gets to run
+  int old_fd = fds[0];
+  check_eq(grn_close(fds[0]), 0);
+  close(fds[1]);
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+  check_eq(fds[0], old_fd);
+  check_eq(write(fds[1], "pong", 4), 4);
+
+  long bytes_read = 0;
+  grn_join(id, (void **)&bytes_read);
+  check_eq(bytes_read, -1);
+  check_eq(closed_read_errno, EBADF);
+
+  // The new socket's data is still there
+  char buf[8];
+  check_eq(grn_read(fds[0], buf, sizeof(buf)), 4);
+
+  close(fds[0]);
+  close(fds[1]);
+  return true;
+}
+
+static void *poller(void *arg) {
+  struct pollfd *fds = arg;
+  return (void *)(long)grn_poll(fds, 2, -1);
+}
+
+static bool poll_test() {
+  int a[2], b[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, a), 0);
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, b), 0);
+
+  grn_init(false);
+
+  struct pollfd fds[2] = {{.fd = a[0], .events = POLLIN}, {.fd = b[0], .events = POLLIN}};
+  int64_t id = grn_spawn(poller, fds);
+
+  // Only the second fd becomes readable
+  check_eq(write(b[1], "x", 1), 1);
+
+  long ready = 0;
+  grn_join(id, (void **)&ready);
+  check_eq(ready, 1);
+  check_eq(fds[0].revents, 0);
+  check(fds[1].revents & POLLIN);
+
+  return true;
+}
+
+static bool poll_timeout_test() {
+  int a[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, a), 0);
+
+  grn_init(false);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct pollfd fd = {.fd = a[0], .events = POLLIN};
+  check_eq(grn_poll(&fd, 1, 50), 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  check(elapsed_ms >= 50);
+
+  return true;
+}
+
+static int listen_local(struct sockaddr_in *addr) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr->sin_port = 0;
+
+  socklen_t len = sizeof(*addr);
+  if (bind(listener, (struct sockaddr *)addr, len) || listen(listener, 4) ||
+      getsockname(listener, (struct sockaddr *)addr, &len)) {
+    return -1;
+  }
+
+  return listener;
+}
+
+static void *accept_and_readv(void *arg) {
+  int listener = (int)(long)arg;
+  int conn = grn_accept(listener, NULL, NULL);
+
+  char first[6] = {0}, second[6] = {0};
+  struct iovec iov[2] = {{first, 6}, {second, 5}};
+
+  ssize_t total = 0;
+  while (total < 11) {
+    ssize_t bytes_read = grn_readv(conn, iov, 2);
+    if (bytes_read <= 0) break;
+    total += bytes_read;
+    // Skip past what was read in case it came in pieces
+    for (int i = 0; i < 2; i++) {
+      size_t used = (size_t)bytes_read < iov[i].iov_len ? (size_t)bytes_read : iov[i].iov_len;
+      iov[i].iov_base = (char *)iov[i].iov_base + used;
+      iov[i].iov_len -= used;
+      bytes_read -= used;
+    }
+  }
+
+  close(conn);
+  bool matches = !memcmp(first, "hello ", 6) && !memcmp(second, "world", 5);
+  return (void *)(long)(matches ? total : -1);
+}
+
+static bool connect_test() {
+  struct sockaddr_in addr;
+  int listener = listen_local(&addr);
+  check(listener >= 0);
+
+  grn_init(false);
+  int64_t id = grn_spawn(accept_and_readv, (void *)(long)listener);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  check_eq(grn_connect(client, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+  // The socket is left in blocking mode
+  check_eq(fcntl(client, F_GETFL) & O_NONBLOCK, 0);
+
+  char hello[] = "hello ", world[] = "world";
+  struct iovec iov[2] = {{hello, 6}, {world, 5}};
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+  check_eq(grn_sendmsg(client, &msg, 0), 11);
+
+  long total = 0;
+  grn_join(id, (void **)&total);
+  check_eq(total, 11);
+
+  close(client);
+  close(listener);
+  return true;
+}
+
+static bool connect_refused_test() {
+  struct sockaddr_in addr;
+  int listener = listen_local(&addr);
+  check(listener >= 0);
+  close(listener);
+
+  grn_init(false);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  check_eq(grn_connect(client, (struct sockaddr *)&addr, sizeof(addr)), -1);
+  check_eq(errno, ECONNREFUSED);
+
+  close(client);
+  return true;
+}
+
+static bool sendfile_test() {
+  char path[] = "/tmp/chloros_io_testXXXXXX";
+  int fd = mkstemp(path);
+  check(fd >= 0);
+  unlink(path);
+  check_eq(write(fd, "static file", 11), 11);
+
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  grn_init(false);
+
+  off_t offset = 7;
+  check_eq(grn_sendfile(fds[0], fd, &offset, 4), 4);
+  check_eq(offset, 11);
+
+  char buf[8] = {0};
+  check_eq(read(fds[1], buf, sizeof(buf)), 4);
+  check_eq_str(buf, "file");
+
+  close(fd);
+  close(fds[0]);
+  close(fds[1]);
+  return true;
+}
+
+static void *relay(void *arg) {
+  int *fds = arg;
+  return (void *)grn_splice_copy(fds[0], fds[1], 64);
+}
+
+static bool splice_copy_test() {
+  int in[2], out[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, in), 0);
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, out), 0);
+
+  grn_init(false);
+
+  // The relay parks until there is something to move
+  int relay_fds[2] = {in[0], out[0]};
+  int64_t id = grn_spawn(relay, relay_fds);
+  check_eq(write(in[1], "proxied", 7), 7);
+
+  long moved = 0;
+  grn_join(id, (void **)&moved);
+  check_eq(moved, 7);
+
+  char buf[8] = {0};
+  check_eq(read(out[1], buf, sizeof(buf)), 7);
+  check_eq_str(buf, "proxied");
+
+  // The pipe went back to the pool and comes out again empty
+  int pipefd[2];
+  check_eq(grn_pipe_acquire(pipefd), 0);
+  check_eq(read(pipefd[0], buf, 1), -1);
+  check_eq(errno, EAGAIN);
+  grn_pipe_release(pipefd);
+
+  close(in[0]);
+  close(in[1]);
+  close(out[0]);
+  close(out[1]);
+  return true;
+}
+
+static int bind_udp(struct sockaddr_in *addr) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t len = sizeof(*addr);
+  if (bind(sock, (struct sockaddr *)addr, len) ||
+      getsockname(sock, (struct sockaddr *)addr, &len)) {
+    return -1;
+  }
+
+  return sock;
+}
+
+static void *batch_receiver(void *arg) {
+  int sock = (int)(long)arg;
+
+  char bufs[4][8] = {{0}};
+  struct iovec iov[4];
+  struct mmsghdr msgs[4];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < 4; i++) {
+    iov[i] = (struct iovec){bufs[i], sizeof(bufs[i])};
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // Asks for 4 but only 3 are ever sent, the call returns what is queued
+  int count = grn_recvmmsg(sock, msgs, 4, 0);
+  if (count != 3 || strcmp(bufs[0], "one") || strcmp(bufs[2], "three")) return (void *)-1L;
+
+  return (void *)(long)count;
+}
+
+static bool udp_batch_test() {
+  struct sockaddr_in rx_addr, tx_addr;
+  int rx = bind_udp(&rx_addr);
+  int tx = bind_udp(&tx_addr);
+  check(rx >= 0 && tx >= 0);
+  check_eq(connect(tx, (struct sockaddr *)&rx_addr, sizeof(rx_addr)), 0);
+
+  grn_init(false);
+  int64_t id = grn_spawn(batch_receiver, (void *)(long)rx);
+
+  char one[] = "one", two[] = "two", three[] = "three";
+  struct iovec iov[3] = {{one, 4}, {two, 4}, {three, 6}};
+  struct mmsghdr msgs[3];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < 3; i++) {
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  check_eq(grn_sendmmsg(tx, msgs, 3, 0), 3);
+
+  long count = 0;
+  grn_join(id, (void **)&count);
+  check_eq(count, 3);
+
+  // Single datagrams carry the sender's address back
+  check_eq(grn_sendto(rx, "ack", 4, 0, (struct sockaddr *)&tx_addr, sizeof(tx_addr)), 4);
+
+  char buf[8] = {0};
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  check_eq(grn_recvfrom(tx, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len), 4);
+  check_eq_str(buf, "ack");
+  check_eq(from.sin_port, rx_addr.sin_port);
+
+  close(rx);
+  close(tx);
+  return true;
+}
+
+static int handlers_running = 0;
+static int handlers_peak = 0;
+
+static void *echo_handler(void *arg) {
+  int conn = (int)(intptr_t)arg;
+
+  handlers_running++;
+  if (handlers_running > handlers_peak) handlers_peak = handlers_running;
+  // Give the server a chance to go over its limit
+  grn_yield();
+
+  char buf[16];
+  ssize_t bytes_read = grn_read(conn, buf, sizeof(buf));
+  if (bytes_read > 0) grn_write(conn, buf, bytes_read);
+
+  handlers_running--;
+  close(conn);
+  return NULL;
+}
+
+static void *server(void *arg) {
+  grn_serve_opts opts = {.max_concurrency = 2};
+  return (void *)(long)grn_listen_serve((int)(long)arg, echo_handler, &opts);
+}
+
+static bool listen_serve_test() {
+  struct sockaddr_in addr;
+  int listener = listen_local(&addr);
+  check(listener >= 0);
+
+  grn_init(false);
+  grn_spawn(server, (void *)(long)listener);
+
+  // All three are in the backlog with a request before the server gets to run
+  // again, the third is only accepted once one of the first two handlers is
+  // done
+  int clients[3];
+  for (int i = 0; i < 3; i++) {
+    clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+    check_eq(connect(clients[i], (struct sockaddr *)&addr, sizeof(addr)), 0);
+    check_eq(write(clients[i], "echo", 4), 4);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    char buf[8] = {0};
+    check_eq(grn_read(clients[i], buf, sizeof(buf)), 4);
+    check_eq_str(buf, "echo");
+    close(clients[i]);
+  }
+
+  check_eq(handlers_peak, 2);
+  check_eq(fcntl(listener, F_GETFL) & O_NONBLOCK, O_NONBLOCK);
+
+  close(listener);
+  return true;
+}
+
+static volatile int spins = 0;
+
+static void *spinner(void *arg) {
+  (void)arg;
+  while (spins < 1000) {
+    spins++;
+    grn_yield();
+  }
+  return NULL;
+}
+
+static void *slow_open(void *arg) {
+  // Stands in for a call that blocks in the kernel
+  usleep(50 * 1000);
+  return (void *)(long)open(arg, O_RDONLY);
+}
+
+static bool offload_test() {
+  grn_init(false);
+  int64_t id = grn_spawn(spinner, NULL);
+
+  // The spinner keeps running while the call is out on the pool
+  char path[] = "/nonexistent/chloros";
+  long fd = (long)grn_offload(slow_open, path);
+  check_eq(fd, -1);
+  check_eq(errno, ENOENT);
+  check(spins > 0);
+
+  grn_join(id, NULL);
+  return true;
+}
+
+static void *sleeper(void *arg) {
+  struct timespec req = {0, (long)arg}, rem = {1, 1};
+  long ret = grn_nanosleep(&req, &rem);
+  return (void *)(ret == 0 && rem.tv_sec == 0 && rem.tv_nsec == 0 ? 0L : -1L);
+}
+
+static bool nanosleep_test() {
+  grn_init(false);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Two sleeps overlap rather than adding up
+  int64_t first = grn_spawn(sleeper, (void *)50000000L);
+  int64_t second = grn_spawn(sleeper, (void *)50000000L);
+
+  long ret = -1;
+  grn_join(first, (void **)&ret);
+  check_eq(ret, 0);
+  grn_join(second, (void **)&ret);
+  check_eq(ret, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  check(elapsed_ms >= 50 && elapsed_ms < 95);
+
+  struct timespec bad = {0, 1000000000L};
+  check_eq(grn_nanosleep(&bad, NULL), -1);
+  check_eq(errno, EINVAL);
+
+  return true;
+}
+
+BEGIN_TEST_SUITE(io_tests) {
+  run_test(coop_budget_test);
+  run_test(coop_budget_disabled_test);
+  run_test(full_duplex_test);
+  run_test(regular_file_test);
+  run_test(fd_reuse_test);
+  run_test(fd_mode_reuse_test);
+  run_test(close_reuse_test);
+  run_test(poll_test);
+  run_test(poll_timeout_test);
+  run_test(connect_test);
+  run_test(connect_refused_test);
+  run_test(sendfile_test);
+  run_test(splice_copy_test);
+  run_test(udp_batch_test);
+  run_test(listen_serve_test);
+  run_test(offload_test);
+  run_test(nanosleep_test);
+}
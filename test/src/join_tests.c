@@ -51,7 +51,18 @@ static bool nested_join_test() {
   return true;
 }
 
+static bool unjoinable_test() {
+  grn_init(false);
+
+  // Fails, and leaves preemption enabled
+  check_eq(grn_join(12345, NULL), -1);
+  check_eq(grn_current()->preempt_count, 0);
+
+  return true;
+}
+
 BEGIN_TEST_SUITE(join_tests) {
   run_test(simple_join_test);
   run_test(nested_join_test);
+  run_test(unjoinable_test);
 }
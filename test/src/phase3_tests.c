@@ -5,6 +5,7 @@
 #include <unistd.h>
 
 #include "chloros.h"
+#include "runq.h"
 #include "test.h"
 #include "thread.h"
 
@@ -29,6 +30,7 @@ static bool two_threads_yield() {
       :);
 
   t1->status = READY;
+  grn_rq_enqueue((grn_thread *)t1, true);
 
   grn_yield();
   check_eq(grn_current()->id, 1);
@@ -73,6 +75,8 @@ static bool three_threads_yield() {
   t2->context = t1->context;
   t1->status = READY;
   t2->status = READY;
+  grn_rq_enqueue((grn_thread *)t1, true);
+  grn_rq_enqueue((grn_thread *)t2, true);
 
   grn_yield();
   check_eq(grn_current()->id, 2);
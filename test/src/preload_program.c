@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chloros.h"
+
+/*
+ * Run by preload_tests with lib/libchloros_preload.so in LD_PRELOAD. It isn't
+ * linked against chloros: the green thread calls come from the preloaded
+ * library, and the I/O is plain blocking read(), write() and close() that the
+ * library interposes, as in code that wasn't written against chloros.
+ *
+ * Exits with 0 on success, 1 if a check failed and 2 if the library wasn't
+ * preloaded.
+ */
+
+static void (*init)(bool);
+static int (*spawn)(grn_fn, void *);
+static int (*join)(int64_t, void **);
+static int (*yield)();
+
+static volatile bool reader_parked = false;
+
+static void *reader(void *arg) {
+  int fd = (int)(long)arg;
+  char buf[8];
+
+  // Nothing to read yet, the process would block here without the library
+  reader_parked = true;
+  return (void *)read(fd, buf, sizeof(buf));
+}
+
+#define BIG_WRITE (4 << 20)
+
+static char big[BIG_WRITE];
+static volatile bool yielder_done = false;
+
+static void *yielder(void *arg) {
+  (void)arg;
+  // Polls for events itself, from outside any interposed call
+  while (!yielder_done) yield();
+  return NULL;
+}
+
+#define expect(cond)                                                      \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      fprintf(stderr, "%s:%d: '%s' failed\n", __FILE__, __LINE__, #cond); \
+      return 1;                                                           \
+    }                                                                     \
+  } while (0)
+
+int main() {
+  init = (void (*)(bool))dlsym(RTLD_DEFAULT, "grn_init");
+  spawn = (int (*)(grn_fn, void *))dlsym(RTLD_DEFAULT, "grn_spawn");
+  join = (int (*)(int64_t, void **))dlsym(RTLD_DEFAULT, "grn_join");
+  yield = (int (*)())dlsym(RTLD_DEFAULT, "grn_yield");
+  if (init == NULL || spawn == NULL || join == NULL || yield == NULL) return 2;
+
+  init(false);
+
+  int fds[2];
+  expect(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  // The reader parks on the blocking socket and the main thread goes on
+  int64_t id = spawn(reader, (void *)(long)fds[0]);
+  expect(reader_parked);
+
+  // File I/O goes through the offload pool
+  char path[] = "/tmp/chloros_preloadXXXXXX";
+  int file = mkstemp(path);
+  expect(file >= 0);
+  unlink(path);
+
+  char buf[8] = {0};
+  expect(write(file, "data", 4) == 4);
+  expect(lseek(file, 0, SEEK_SET) == 0);
+  expect(read(file, buf, sizeof(buf)) == 4);
+  expect(strcmp(buf, "data") == 0);
+  expect(close(file) == 0);
+
+  // The offload completions are picked up by the yielding thread's polls,
+  // which must leave the scheduler's own eventfd armed
+  int64_t yielder_id = spawn(yielder, NULL);
+  strcpy(path, "/tmp/chloros_preloadXXXXXX");
+  file = mkstemp(path);
+  expect(file >= 0);
+  unlink(path);
+
+  for (int i = 0; i < 2; i++) expect(write(file, big, BIG_WRITE) == BIG_WRITE);
+  expect(close(file) == 0);
+
+  yielder_done = true;
+  expect(join(yielder_id, NULL) == 0);
+
+  expect(write(fds[1], "ping", 4) == 4);
+
+  long bytes_read = 0;
+  expect(join(id, (void **)&bytes_read) == 0);
+  expect(bytes_read == 4);
+
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
@@ -0,0 +1,37 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "test.h"
+
+#define PRELOAD_LIB "lib/libchloros_preload.so"
+#define PRELOAD_PROGRAM "bin/preload_program"
+
+static bool interpose_test() {
+  // Both are built by `make test`
+  check_eq(access(PRELOAD_LIB, R_OK), 0);
+  check_eq(access(PRELOAD_PROGRAM, X_OK), 0);
+
+  pid_t pid = fork();
+  check(pid != -1);
+
+  if (pid == 0) {
+    setenv("LD_PRELOAD", PRELOAD_LIB, 1);
+    execl(PRELOAD_PROGRAM, PRELOAD_PROGRAM, (char *)NULL);
+    _exit(127);
+  }
+
+  // A read() that blocked the process would hang it, and time the test out
+  int status;
+  check_eq(waitpid(pid, &status, 0), pid);
+  check(WIFEXITED(status));
+  check_eq(WEXITSTATUS(status), 0);
+  return true;
+}
+
+BEGIN_TEST_SUITE(preload_tests) {
+  run_test(interpose_test);
+}
@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chloros.h"
+#include "test.h"
+
+static volatile uint64_t sink = 0;
+
+static void *spin(void *arg) {
+  long iters = (long)arg;
+  for (long i = 0; i < iters; i++) {
+    sink += i;
+  }
+
+  return NULL;
+}
+
+static bool profile_dump_test() {
+  grn_init(false);
+  check_eq(grn_profile_start(1000), 0);
+
+  int64_t id = grn_spawn(spin, (void *)200000000L);
+  grn_join(id, NULL);
+
+  grn_profile_stop();
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  grn_profile_dump(out);
+  fclose(out);
+
+  // Every sample line is tagged with the green thread that was running
+  char expecting[32];
+  snprintf(expecting, 32, "grn-%ld", (long)id);
+  check(strstr(buf, expecting) != NULL);
+
+  // Each folded line ends in a sample count
+  char *line = strtok(buf, "\n");
+  while (line != NULL) {
+    char *count = strrchr(line, ' ');
+    check(count != NULL);
+    check(atoi(count + 1) > 0);
+    line = strtok(NULL, "\n");
+  }
+
+  free(buf);
+  return true;
+}
+
+static bool profile_range_test() {
+  grn_init(false);
+
+  // The whole range is accepted, down to one sample a second
+  check_eq(grn_profile_start(1), 0);
+  check_eq(grn_profile_start(1000000), 0);
+  grn_profile_stop();
+
+  check_eq(grn_profile_start(0), -1);
+  check_eq(errno, EINVAL);
+  check_eq(grn_profile_start(1000001), -1);
+  return true;
+}
+
+BEGIN_TEST_SUITE(profile_tests) {
+  run_test(profile_dump_test);
+  run_test(profile_range_test);
+}
@@ -0,0 +1,490 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "runq.h"
+#include "test.h"
+#include "thread.h"
+
+#define LOG_SIZE 64
+
+static char order[LOG_SIZE];
+static volatile int order_len = 0;
+
+static void *log_and_yield(void *arg) {
+  char tag = (char)(long)arg;
+  for (int i = 0; i < 3; i++) {
+    order[order_len++] = tag;
+    grn_yield();
+  }
+  return NULL;
+}
+
+static bool waiting_not_queued_test() {
+  grn_init(false);
+
+  // A thread that isn't READY yet isn't in the run queues
+  grn_thread *thread = grn_new_thread(false);
+  check(grn_rq_empty());
+  check_eq(grn_yield(), -1);
+
+  grn_destroy_thread(thread);
+  return true;
+}
+
+static bool priority_order_test() {
+  order_len = 0;
+  grn_init(false);
+
+  // The batch thread is less urgent than us and waits, the health check is
+  // more urgent and runs to completion right away
+  check(grn_spawn_prio(log_and_yield, (void *)'b', 6) > 0);
+  check(grn_spawn_prio(log_and_yield, (void *)'h', 1) > 0);
+  order[order_len++] = 'm';
+
+  grn_wait();
+  order[order_len] = '\0';
+  check_eq_str(order, "hhhmbbb");
+
+  check_eq(grn_spawn_prio(log_and_yield, NULL, GRN_PRIO_LEVELS), -1);
+  check_eq(errno, EINVAL);
+  return true;
+}
+
+static bool set_priority_test() {
+  order_len = 0;
+  grn_init(false);
+
+  grn_spawn_prio(log_and_yield, (void *)'a', 6);
+  grn_spawn_prio(log_and_yield, (void *)'b', 6);
+
+  // Neither has run yet, until we drop below them
+  check_eq(order_len, 0);
+  grn_thread *self = grn_current();
+  check_eq(grn_set_priority(self, GRN_PRIO_LOWEST), 0);
+  grn_yield();
+  order[order_len++] = 'm';
+  order[order_len] = '\0';
+  check_eq_str(order, "abababm");
+
+  check_eq(grn_set_priority(self, -1), -1);
+  check_eq(self->priority, GRN_PRIO_LOWEST);
+  return true;
+}
+
+static volatile bool batch_ran = false;
+static volatile int urgent_spins = 0;
+
+static void *batch(void *arg) {
+  (void)arg;
+  batch_ran = true;
+  return NULL;
+}
+
+static void *urgent(void *arg) {
+  (void)arg;
+  // Keeps yielding without ever blocking, only aging lets the batch thread in
+  while (!batch_ran && urgent_spins < 10000) {
+    urgent_spins++;
+    grn_yield();
+  }
+  return NULL;
+}
+
+static void *urgent_peer(void *arg) {
+  (void)arg;
+  while (!batch_ran && urgent_spins < 10000) grn_yield();
+  return NULL;
+}
+
+static bool aging_test() {
+  grn_init(false);
+  grn_set_aging(16);
+
+  int64_t batch_id = grn_spawn_prio(batch, NULL, GRN_PRIO_LOWEST);
+  int64_t urgent_id = grn_spawn_prio(urgent, NULL, GRN_PRIO_HIGHEST);
+  int64_t peer_id = grn_spawn_prio(urgent_peer, NULL, GRN_PRIO_HIGHEST);
+
+  grn_join(urgent_id, NULL);
+  grn_join(peer_id, NULL);
+  grn_join(batch_id, NULL);
+
+  check(batch_ran);
+  check(urgent_spins < 100);
+  return true;
+}
+
+static volatile bool hog_done = false;
+static volatile int quick_turns = 0;
+static volatile int hog_turns = 0;
+
+static void spin_for_ms(long ms) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < ms);
+}
+
+static void *hog(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 5; i++) {
+    hog_turns++;
+    spin_for_ms(2);
+    grn_yield();
+  }
+  hog_done = true;
+  return NULL;
+}
+
+static void *quick(void *arg) {
+  (void)arg;
+  while (!hog_done) {
+    quick_turns++;
+    grn_yield();
+  }
+  return NULL;
+}
+
+static bool fair_test() {
+  grn_init(false);
+  check_eq(grn_set_policy(&grn_policy_fair), 0);
+
+  int64_t hog_id = grn_spawn(hog, NULL);
+  int64_t quick_id = grn_spawn(quick, NULL);
+
+  grn_join(hog_id, NULL);
+  grn_join(quick_id, NULL);
+
+  // Round-robin would alternate, the quick thread gets a turn per turn of the
+  // hog. Fair scheduling runs it until it has used as much CPU time
+  check_eq(hog_turns, 5);
+  check(quick_turns > 10 * hog_turns);
+
+  check_eq(grn_set_policy(NULL), -1);
+  check_eq(errno, EINVAL);
+  return true;
+}
+
+static bool fair_weight_test() {
+  grn_init(false);
+  check_eq(grn_set_policy(&grn_policy_fair), 0);
+
+  grn_thread *self = grn_current();
+
+  // The same CPU time counts for less virtual time at a more urgent level
+  uint64_t before = self->vruntime;
+  spin_for_ms(2);
+  grn_yield();
+  uint64_t normal = self->vruntime - before;
+
+  grn_set_priority(self, GRN_PRIO_HIGHEST);
+  before = self->vruntime;
+  spin_for_ms(2);
+  grn_yield();
+  uint64_t urgent = self->vruntime - before;
+
+  check(self->runtime >= 4000000);
+  check(urgent < normal);
+  return true;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void *burn(void *arg) {
+  long ms = (long)arg;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (elapsed_ms(&start) < ms) {
+    spin_for_ms(1);
+    grn_yield();
+  }
+  return NULL;
+}
+
+static bool group_quota_test() {
+  grn_init(false);
+
+  grn_group *group = grn_group_create(GRN_GROUP_SHARES_DEFAULT);
+  check(group != NULL);
+  check_eq(grn_group_set_quota(group, 2000, 10000), 0);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int64_t id = grn_spawn_group(group, burn, (void *)50);
+
+  check_eq(grn_group_destroy(group), -1);
+  check_eq(errno, EBUSY);
+
+  grn_join(id, NULL);
+  long wall_ms = elapsed_ms(&start);
+
+  // 2ms out of every 10ms, give or take the 1ms it can overrun by
+  grn_group_stats stats;
+  grn_group_get_stats(group, &stats);
+  check(stats.throttle_count >= 3);
+  check(stats.throttled_time > 0);
+  check(stats.runtime < (uint64_t)wall_ms * 1000000 / 2);
+  check_eq(stats.threads, 0);
+
+  check_eq(grn_group_destroy(group), 0);
+  check(grn_group_create(0) == NULL);
+  return true;
+}
+
+static bool group_shares_test() {
+  grn_init(false);
+  check_eq(grn_set_policy(&grn_policy_fair), 0);
+
+  grn_group *solo = grn_group_create(GRN_GROUP_SHARES_DEFAULT);
+  grn_group *crowd = grn_group_create(GRN_GROUP_SHARES_DEFAULT);
+
+  int64_t ids[5];
+  ids[0] = grn_spawn_group(solo, burn, (void *)40);
+  for (int i = 1; i < 5; i++) ids[i] = grn_spawn_group(crowd, burn, (void *)40);
+  for (int i = 0; i < 5; i++) grn_join(ids[i], NULL);
+
+  // Equal shares, so the lone thread gets about as much CPU as the other
+  // four together rather than a fifth of it
+  grn_group_stats solo_stats, crowd_stats;
+  grn_group_get_stats(solo, &solo_stats);
+  grn_group_get_stats(crowd, &crowd_stats);
+  check(solo_stats.runtime * 2 > crowd_stats.runtime);
+  check(crowd_stats.runtime * 2 > solo_stats.runtime);
+
+  grn_group_destroy(solo);
+  grn_group_destroy(crowd);
+  return true;
+}
+
+static grn_waker wakers[3];
+
+static void *park_and_log(void *arg) {
+  long i = (long)arg;
+  grn_park(&wakers[i]);
+  order[order_len++] = '0' + i;
+  return NULL;
+}
+
+/**
+ * Parks three threads, wakes them in order and returns the order they ran in.
+ */
+static const char *wake_order() {
+  order_len = 0;
+
+  int64_t ids[3];
+  for (long i = 0; i < 3; i++) {
+    grn_waker_init(&wakers[i]);
+    ids[i] = grn_spawn(park_and_log, (void *)i);
+  }
+
+  for (int i = 0; i < 3; i++) grn_wake(&wakers[i]);
+  for (int i = 0; i < 3; i++) grn_join(ids[i], NULL);
+
+  order[order_len] = '\0';
+  return order;
+}
+
+static bool fifo_policy_test() {
+  grn_init_policy(false, &grn_policy_fifo);
+  check_eq_str(wake_order(), "012");
+  return true;
+}
+
+static bool lifo_policy_test() {
+  grn_init_policy(false, &grn_policy_lifo);
+  check_eq_str(wake_order(), "210");
+  return true;
+}
+
+static int ticks = 0;
+static int blocks = 0;
+
+static void count_block(grn_thread *thread) {
+  (void)thread;
+  blocks++;
+}
+
+static void count_tick(grn_thread *thread, uint64_t ns) {
+  (void)thread;
+  (void)ns;
+  ticks++;
+}
+
+static bool custom_policy_test() {
+  // The FIFO policy with counting hooks
+  grn_policy counting = grn_policy_fifo;
+  counting.name = "counting";
+  counting.on_block = count_block;
+  counting.on_tick = count_tick;
+
+  grn_init_policy(false, &counting);
+  check_eq_str(wake_order(), "012");
+  check(blocks >= 3);
+  check(ticks > 0);
+  return true;
+}
+
+static bool run_next_test() {
+  grn_init_policy(false, &grn_policy_fifo);
+  grn_set_run_next(4);
+
+  // The last one woken runs first, the others in order
+  check_eq_str(wake_order(), "201");
+  return true;
+}
+
+static grn_waker ping, pong;
+static volatile int rounds = 0;
+static volatile int bystander_turns = 0;
+
+static void *pinger(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 50; i++) {
+    grn_wake(&pong);
+    grn_park(&ping);
+    rounds++;
+  }
+  return NULL;
+}
+
+static void *ponger(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 50; i++) {
+    grn_park(&pong);
+    grn_wake(&ping);
+  }
+  return NULL;
+}
+
+static void *bystander(void *arg) {
+  (void)arg;
+  while (rounds < 50) {
+    bystander_turns++;
+    grn_yield();
+  }
+  return NULL;
+}
+
+/**
+ * Runs two threads waking each other next to one that only yields, and
+ * returns how many turns the latter got during the exchange.
+ */
+static int ping_pong_turns(uint32_t limit) {
+  grn_init_policy(false, &grn_policy_fifo);
+  grn_set_run_next(limit);
+
+  rounds = 0;
+  bystander_turns = 0;
+  grn_waker_init(&ping);
+  grn_waker_init(&pong);
+
+  int64_t b = grn_spawn(ponger, NULL);
+  int64_t c = grn_spawn(bystander, NULL);
+  int64_t a = grn_spawn(pinger, NULL);
+
+  grn_join(a, NULL);
+  int turns = bystander_turns;
+  grn_join(b, NULL);
+  grn_join(c, NULL);
+
+  return turns;
+}
+
+static bool run_next_bound_test() {
+  // Unbounded, the pair hands the CPU back and forth and starves the third
+  check(ping_pong_turns(UINT32_MAX) <= 2);
+  // Bounded, it gets a turn at least every few handoffs
+  check(ping_pong_turns(2) >= 20);
+  return true;
+}
+
+static bool idle_spin_test() {
+  grn_init(false);
+  grn_set_idle_spin(4000);
+
+  // Nothing shows up within the window, it shrinks
+  struct timespec long_sleep = {0, 20 * 1000 * 1000};
+  grn_nanosleep(&long_sleep, NULL);
+  check_eq(STATE.spin_us, 2000);
+  grn_nanosleep(&long_sleep, NULL);
+  grn_nanosleep(&long_sleep, NULL);
+  grn_nanosleep(&long_sleep, NULL);
+  check_eq(STATE.spin_us, 500);
+
+  // A wakeup caught while spinning grows it back
+  struct timespec short_sleep = {0, 100 * 1000};
+  grn_nanosleep(&short_sleep, NULL);
+  check_eq(STATE.spin_us, 1000);
+
+  grn_set_idle_spin(0);
+  grn_nanosleep(&short_sleep, NULL);
+  check_eq(STATE.spin_us, 0);
+  return true;
+}
+
+static bool idle_spin_quota_test() {
+  grn_init(false);
+  grn_set_idle_spin(50);
+
+  grn_group *group = grn_group_create(GRN_GROUP_SHARES_DEFAULT);
+  check_eq(grn_group_set_quota(group, 1000, 10000), 0);
+
+  struct timespec start, cpu_start, cpu_end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+  int64_t id = grn_spawn_group(group, burn, (void *)200);
+  grn_join(id, NULL);
+
+  long wall_ms = elapsed_ms(&start);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+  long cpu_ms = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000 +
+                (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000000;
+
+  // While the thread is throttled the scheduler sleeps until the refill
+  // rather than spinning
+  check(cpu_ms < wall_ms / 2);
+
+  grn_group_destroy(group);
+  return true;
+}
+
+static bool env_policy_test() {
+  setenv("CHLOROS_SCHED", "lifo", 1);
+  check(grn_policy_from_env() == &grn_policy_lifo);
+  setenv("CHLOROS_SCHED", "fair", 1);
+  check(grn_policy_from_env() == &grn_policy_fair);
+  unsetenv("CHLOROS_SCHED");
+  check(grn_policy_from_env() == &grn_policy_priority);
+  return true;
+}
+
+BEGIN_TEST_SUITE(sched_tests) {
+  run_test(waiting_not_queued_test);
+  run_test(priority_order_test);
+  run_test(set_priority_test);
+  run_test(aging_test);
+  run_test(fair_test);
+  run_test(fair_weight_test);
+  run_test(group_quota_test);
+  run_test(group_shares_test);
+  run_test(fifo_policy_test);
+  run_test(lifo_policy_test);
+  run_test(custom_policy_test);
+  run_test(run_next_test);
+  run_test(run_next_bound_test);
+  run_test(idle_spin_test);
+  run_test(idle_spin_quota_test);
+  run_test(env_policy_test);
+}
@@ -0,0 +1,199 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "test.h"
+
+#define SHARDS 3
+#define HOPS 30
+#define CONNECTIONS 24
+
+static int received_on[SHARDS];
+static int received_count = 0;
+
+static void *receive(void *arg) {
+  int target = (int)(intptr_t)arg;
+  received_on[target] = grn_shard_id();
+  __atomic_add_fetch(&received_count, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void *send_to_next(void *arg) {
+  (void)arg;
+  int next = (grn_shard_id() + 1) % grn_shard_count();
+  grn_shard_submit(next, receive, (void *)(intptr_t)next);
+  return NULL;
+}
+
+static bool shard_submit_test() {
+  received_count = 0;
+  memset(received_on, -1, sizeof(received_on));
+
+  check_eq(grn_shard_run(SHARDS, false, send_to_next, NULL), 0);
+
+  // Each shard got one message and ran it itself
+  check_eq(received_count, SHARDS);
+  for (int i = 0; i < SHARDS; i++) check_eq(received_on[i], i);
+
+  check_eq(grn_shard_id(), -1);
+  check_eq(grn_shard_count(), 0);
+  check_eq(grn_shard_submit(0, receive, NULL), -1);
+  return true;
+}
+
+static grn_waker chain_done;
+static int hops = 0;
+
+static void *hop(void *arg) {
+  (void)arg;
+  if (++hops == HOPS) {
+    // Lands on shard 0's inbox, whichever shard we're on
+    grn_wake(&chain_done);
+    return NULL;
+  }
+
+  grn_shard_submit((grn_shard_id() + 1) % grn_shard_count(), hop, NULL);
+  return NULL;
+}
+
+static void *start_chain(void *arg) {
+  (void)arg;
+  if (grn_shard_id() != 0) return NULL;
+
+  grn_shard_submit(1, hop, NULL);
+  grn_park(&chain_done);
+  return NULL;
+}
+
+static bool shard_chain_test() {
+  hops = 0;
+  grn_waker_init(&chain_done);
+
+  check_eq(grn_shard_run(SHARDS, false, start_chain, NULL), 0);
+  check_eq(hops, HOPS);
+  return true;
+}
+
+static uint16_t port;
+static int served = 0;
+static volatile bool stop_serving = false;
+
+static void *serve_one_shard(void *arg) {
+  (void)arg;
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = port};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = grn_listen_reuseport((struct sockaddr *)&addr, sizeof(addr), 64);
+  if (fd == -1) return NULL;
+
+  while (!stop_serving) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (grn_poll(&pfd, 1, 20) <= 0) continue;
+
+    int conn = accept(fd, NULL, NULL);
+    if (conn == -1) continue;
+
+    char id = '0' + grn_shard_id();
+    grn_write(conn, &id, 1);
+    close(conn);
+    __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static void *connect_all(void *arg) {
+  int *replies = arg;
+
+  for (int i = 0; i < CONNECTIONS; i++) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = port};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    // The shards may not all be listening yet
+    while (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) usleep(1000);
+
+    char id;
+    if (read(fd, &id, 1) == 1) (*replies)++;
+    close(fd);
+  }
+
+  stop_serving = true;
+  return NULL;
+}
+
+static bool shard_reuseport_test() {
+  // Find a free port
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int probe = grn_listen_reuseport((struct sockaddr *)&addr, sizeof(addr), 1);
+  check(probe != -1);
+  socklen_t len = sizeof(addr);
+  getsockname(probe, (struct sockaddr *)&addr, &len);
+  port = addr.sin_port;
+  close(probe);
+
+  served = 0;
+  stop_serving = false;
+  int replies = 0;
+
+  pthread_t client;
+  check_eq(pthread_create(&client, NULL, connect_all, &replies), 0);
+  check_eq(grn_shard_run(SHARDS, false, serve_one_shard, NULL), 0);
+  pthread_join(client, NULL);
+
+  check_eq(replies, CONNECTIONS);
+  check_eq(served, CONNECTIONS);
+  return true;
+}
+
+static int offloads_done = 0;
+
+static void *slow_call(void *arg) {
+  (void)arg;
+  usleep(50 * 1000);
+  return NULL;
+}
+
+static void *offloader(void *arg) {
+  (void)arg;
+  grn_offload(slow_call, NULL);
+  __atomic_add_fetch(&offloads_done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void *start_offload(void *arg) {
+  (void)arg;
+  // Parked in the offload pool when the shard's function returns
+  grn_spawn(offloader, NULL);
+  grn_yield();
+  return NULL;
+}
+
+static bool shard_offload_test() {
+  offloads_done = 0;
+
+  // The workers wake the threads through the inboxes of shards that must
+  // still be there
+  check_eq(grn_shard_run(SHARDS, false, start_offload, NULL), 0);
+  check_eq(offloads_done, SHARDS);
+  return true;
+}
+
+BEGIN_TEST_SUITE(shard_tests) {
+  run_test(shard_submit_test);
+  run_test(shard_chain_test);
+  run_test(shard_reuseport_test);
+  run_test(shard_offload_test);
+}
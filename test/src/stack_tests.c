@@ -0,0 +1,68 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chloros.h"
+#include "test.h"
+
+#define DEPTH_BYTES (64 * 1024)
+
+static void *use_stack(void *arg) {
+  size_t bytes = (size_t)arg;
+  volatile char buf[DEPTH_BYTES];
+
+  for (size_t i = 0; i < bytes; i += 512) {
+    buf[i] = 1;
+  }
+  (void)buf;
+
+  return (void *)grn_stack_usage(grn_current());
+}
+
+static bool stack_usage_test() {
+  grn_init(false);
+  grn_stack_paint(true);
+
+  size_t usage = 0;
+  int64_t id = grn_spawn(use_stack, (void *)(size_t)DEPTH_BYTES);
+  grn_join(id, (void **)&usage);
+
+  check(usage >= DEPTH_BYTES);
+  check(usage < DEPTH_BYTES + 16 * 1024);
+
+  // Unpainted threads don't report anything
+  grn_stack_paint(false);
+  id = grn_spawn(use_stack, (void *)(size_t)DEPTH_BYTES);
+  grn_join(id, (void **)&usage);
+  check_eq(usage, 0);
+
+  return true;
+}
+
+static bool stack_report_test() {
+  grn_init(false);
+  grn_stack_paint(true);
+
+  for (int i = 0; i < 4; i++) {
+    int64_t id = grn_spawn(use_stack, (void *)(size_t)DEPTH_BYTES);
+    grn_join(id, NULL);
+  }
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  grn_stack_report(out);
+  fclose(out);
+
+  check(strstr(buf, "over 4 threads") != NULL);
+  check(strstr(buf, "p99") != NULL);
+
+  free(buf);
+  return true;
+}
+
+BEGIN_TEST_SUITE(stack_tests) {
+  run_test(stack_usage_test);
+  run_test(stack_report_test);
+}
@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chloros.h"
+#include "test.h"
+
+static void *request_writer(void *arg) {
+  int fd = (int)(long)arg;
+
+  // The header arrives in pieces, the stream has to stitch them together
+  write(fd, "GET / HT", 8);
+  grn_yield();
+  write(fd, "TP/1.1\nHost: chloros\n", 21);
+  grn_yield();
+  write(fd, "body!", 5);
+  close(fd);
+
+  return NULL;
+}
+
+static bool read_until_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  grn_init(false);
+  grn_stream *stream = grn_stream_open(fds[0]);
+  grn_spawn(request_writer, (void *)(long)fds[1]);
+
+  const char *view;
+  check_eq(grn_stream_read_until(stream, '\n', &view), 15);
+  check(!memcmp(view, "GET / HTTP/1.1\n", 15));
+
+  check_eq(grn_stream_peek(stream, 4, &view), 14);
+  check(!memcmp(view, "Host", 4));
+  check_eq(grn_stream_read_until(stream, '\n', &view), 14);
+
+  check_eq(grn_stream_read_exact(stream, 4, &view), 4);
+  check(!memcmp(view, "body", 4));
+
+  // One byte is left when the writer hangs up
+  check_eq(grn_stream_read_exact(stream, 2, &view), 0);
+  check_eq(grn_stream_read_until(stream, '\n', &view), 0);
+  check_eq(grn_stream_peek(stream, 2, &view), 1);
+  check_eq(*view, '!');
+
+  check_eq(grn_stream_close(stream), 0);
+  return true;
+}
+
+static bool write_coalescing_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  grn_init(false);
+  grn_stream *stream = grn_stream_open(fds[0]);
+
+  check_eq(grn_stream_write(stream, "HTTP/1.1 200 OK\n", 16), 16);
+  check_eq(grn_stream_write(stream, "Length: 0\n", 10), 10);
+
+  // Nothing is sent until the stream is flushed
+  char buf[64] = {0};
+  check_eq(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), -1);
+  check_eq(errno, EAGAIN);
+
+  check_eq(grn_stream_flush(stream), 0);
+  check_eq(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), 26);
+  check(!memcmp(buf, "HTTP/1.1 200 OK\nLength: 0\n", 26));
+
+  // Reading flushes too, so a request is never stuck behind its reply
+  check_eq(grn_stream_write(stream, "ping\n", 5), 5);
+  check_eq(write(fds[1], "pong\n", 5), 5);
+
+  const char *view;
+  check_eq(grn_stream_read_until(stream, '\n', &view), 5);
+  check_eq(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), 5);
+
+  check_eq(grn_stream_close(stream), 0);
+  close(fds[1]);
+  return true;
+}
+
+static bool large_write_test() {
+  int fds[2];
+  check_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  grn_init(false);
+  grn_stream *stream = grn_stream_open(fds[0]);
+
+  size_t size = GRN_STREAM_BUFFER_SIZE + 100;
+  char *data = malloc(size);
+  memset(data, 'x', size);
+
+  // Too big to buffer, it goes out right away behind the buffered byte
+  check_eq(grn_stream_write(stream, "<", 1), 1);
+  check_eq(grn_stream_write(stream, data, size), (ssize_t)size);
+
+  size_t received = 0;
+  char first = 0;
+  while (received < size + 1) {
+    ssize_t bytes_read = recv(fds[1], data, size, MSG_DONTWAIT);
+    check(bytes_read > 0);
+    if (received == 0) first = data[0];
+    received += bytes_read;
+  }
+  check_eq(first, '<');
+
+  free(data);
+  check_eq(grn_stream_close(stream), 0);
+  close(fds[1]);
+  return true;
+}
+
+BEGIN_TEST_SUITE(stream_tests) {
+  run_test(read_until_test);
+  run_test(write_coalescing_test);
+  run_test(large_write_test);
+}
@@ -50,4 +50,15 @@ BEGIN_TESTING {
   // Additional tests for my features
   run_suite(argument_tests);
   run_suite(join_tests);
+  run_suite(profile_tests);
+  run_suite(stack_tests);
+  run_suite(io_tests);
+  run_suite(stream_tests);
+  run_suite(inbox_tests);
+  run_suite(sched_tests);
+  run_suite(shard_tests);
+  run_suite(waitgroup_tests);
+  run_suite(future_tests);
+  run_suite(coro_tests);
+  run_suite(preload_tests);
 }
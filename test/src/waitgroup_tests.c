@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chloros.h"
+#include "main.h"
+#include "test.h"
+
+#define WORKERS 8
+
+static grn_waitgroup wg;
+static volatile int finished = 0;
+
+static void sleep_ms(long ms) {
+  struct timespec req = {0, ms * 1000 * 1000};
+  grn_nanosleep(&req, NULL);
+}
+
+static void *sleep_then_done(void *arg) {
+  sleep_ms((long)(intptr_t)arg);
+  finished++;
+  grn_waitgroup_done(&wg);
+  return NULL;
+}
+
+static bool waitgroup_test() {
+  grn_init(false);
+  grn_waitgroup_init(&wg);
+  finished = 0;
+
+  grn_waitgroup_add(&wg, WORKERS);
+  for (int i = 0; i < WORKERS; i++) grn_spawn(sleep_then_done, (void *)(intptr_t)(i + 1));
+
+  // Every worker is parked on a timer, we park too until the last is done
+  grn_waitgroup_wait(&wg);
+  check_eq(finished, WORKERS);
+  check_eq(wg.count, 0);
+
+  // Nothing to wait for
+  grn_waitgroup_wait(&wg);
+  return true;
+}
+
+static grn_waitgroup round_wg;
+static volatile int rounds_seen = 0;
+
+static void *wait_round(void *arg) {
+  (void)arg;
+  grn_waitgroup_wait(&round_wg);
+  rounds_seen++;
+  return NULL;
+}
+
+static bool waitgroup_reuse_test() {
+  grn_init(false);
+  grn_waitgroup_init(&round_wg);
+  rounds_seen = 0;
+
+  grn_waitgroup_add(&round_wg, 1);
+  int64_t waiter = grn_spawn(wait_round, NULL);
+
+  // The count is back up before the waiter runs, it was still woken
+  grn_waitgroup_done(&round_wg);
+  grn_waitgroup_add(&round_wg, 1);
+  grn_join(waiter, NULL);
+  check_eq(rounds_seen, 1);
+
+  grn_waitgroup_done(&round_wg);
+  return true;
+}
+
+static void *sleep_and_count(void *arg) {
+  sleep_ms((long)(intptr_t)arg);
+  finished++;
+  return NULL;
+}
+
+static int joinable_count() {
+  int count = 0;
+  grn_thread *thread = STATE.joinable_threads;
+  while (thread != NULL) {
+    count++;
+    thread = thread->next;
+  }
+  return count;
+}
+
+static bool scope_test() {
+  grn_init(false);
+  finished = 0;
+
+  // Not ours, the scope doesn't wait for it
+  int64_t outsider = grn_spawn(sleep_and_count, (void *)200L);
+
+  grn_scope scope;
+  grn_scope_init(&scope);
+  for (int i = 0; i < WORKERS; i++) grn_scope_spawn(&scope, sleep_and_count, (void *)(intptr_t)(i + 1));
+
+  grn_scope_wait(&scope);
+  check_eq(finished, WORKERS);
+  // Their stacks are already gone
+  check_eq(joinable_count(), 0);
+
+  // It can be reused
+  grn_scope_spawn(&scope, sleep_and_count, (void *)1L);
+  grn_scope_wait(&scope);
+  check_eq(finished, WORKERS + 1);
+
+  grn_join(outsider, NULL);
+  check_eq(finished, WORKERS + 2);
+  return true;
+}
+
+BEGIN_TEST_SUITE(waitgroup_tests) {
+  run_test(waitgroup_test);
+  run_test(waitgroup_reuse_test);
+  run_test(scope_test);
+}
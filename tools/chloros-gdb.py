@@ -0,0 +1,142 @@
+"""
+gdb helpers for inspecting chloros green threads.
+
+Load with `source tools/chloros-gdb.py` (or from .gdbinit) inside a gdb session
+attached to a program linked against libchloros. Provides:
+
+  grn threads        lists every green thread with its status, spawn function
+                     and the pc it is parked at
+  grn switch <id>    points the selected kernel thread's registers at the saved
+                     grn_context of a parked green thread, so `bt`, `frame`,
+                     `info locals` etc. work on its stack
+  grn restore        puts back the registers saved by the first `grn switch`
+
+Switching only rewrites registers of a stopped process; restore before
+continuing execution. Core files can be listed but not switched into.
+"""
+
+import gdb
+
+# Order of the registers saved in grn_context, after %rsp
+CONTEXT_REGS = ["r15", "r14", "r13", "r12", "rbx", "rbp"]
+LISTS = ["active_threads", "waiting_threads", "joinable_threads"]
+
+saved_regs = None
+
+
+def state():
+    return gdb.parse_and_eval("STATE")
+
+
+def threads():
+    """Yields every grn_thread reachable from the scheduler's lists."""
+    seen = set()
+    st = state()
+    for name in LISTS:
+        thread = st[name]
+        while int(thread) != 0 and int(thread) not in seen:
+            seen.add(int(thread))
+            yield thread
+            thread = thread["next"]
+
+
+def find_thread(thread_id):
+    for thread in threads():
+        if int(thread["id"]) == thread_id:
+            return thread
+    raise gdb.GdbError("no green thread with id %d" % thread_id)
+
+
+def symbol(addr):
+    if addr == 0:
+        return "-"
+    block = gdb.block_for_pc(addr)
+    while block is not None and block.function is None:
+        block = block.superblock
+    if block is not None:
+        return block.function.name
+    # Fall back to the minimal symbol table, e.g. for start_thread
+    desc = gdb.execute("info symbol %#x" % addr, to_string=True).strip()
+    return desc.split(" ")[0] if not desc.startswith("No symbol") else "%#x" % addr
+
+
+def saved_pc(thread):
+    rsp = int(thread["context"]["rsp"])
+    if rsp == 0:
+        return 0
+    ptr = gdb.lookup_type("uint64_t").pointer()
+    return int(gdb.Value(rsp).cast(ptr).dereference())
+
+
+class GrnCommand(gdb.Command):
+    """Commands for inspecting chloros green threads."""
+
+    def __init__(self):
+        super(GrnCommand, self).__init__("grn", gdb.COMMAND_STACK, prefix=True)
+
+
+class GrnThreadsCommand(gdb.Command):
+    """List chloros green threads."""
+
+    def __init__(self):
+        super(GrnThreadsCommand, self).__init__("grn threads", gdb.COMMAND_STACK)
+
+    def invoke(self, arg, from_tty):
+        current = int(state()["current"])
+        print("%-4s %-6s %-10s %-24s %s" % ("", "ID", "STATUS", "FUNCTION", "PARKED AT"))
+        for thread in threads():
+            marker = "*" if int(thread) == current else ""
+            parked = "(running)" if marker else symbol(saved_pc(thread))
+            print("%-4s %-6d %-10s %-24s %s" % (
+                marker, int(thread["id"]), str(thread["status"]),
+                symbol(int(thread["fn"])), parked))
+
+
+class GrnSwitchCommand(gdb.Command):
+    """Switch the selected kernel thread's registers into a parked green thread.
+
+Usage: grn switch ID"""
+
+    def __init__(self):
+        super(GrnSwitchCommand, self).__init__("grn switch", gdb.COMMAND_STACK)
+
+    def invoke(self, arg, from_tty):
+        global saved_regs
+        thread = find_thread(int(gdb.parse_and_eval(arg)))
+        if int(thread) == int(state()["current"]):
+            raise gdb.GdbError("thread %d is running, it has no saved context" % int(thread["id"]))
+
+        frame = gdb.newest_frame()
+        if saved_regs is None:
+            saved_regs = {reg: int(frame.read_register(reg)) for reg in CONTEXT_REGS + ["rsp", "rip"]}
+
+        # grn_context_switch returns by popping the pc off the saved %rsp
+        context = thread["context"]
+        rsp = int(context["rsp"])
+        gdb.execute("set $rip = %#x" % saved_pc(thread), to_string=True)
+        gdb.execute("set $rsp = %#x" % (rsp + 8), to_string=True)
+        for reg in CONTEXT_REGS:
+            gdb.execute("set $%s = %#x" % (reg, int(context[reg])), to_string=True)
+        gdb.execute("frame 0")
+
+
+class GrnRestoreCommand(gdb.Command):
+    """Restore the registers saved by the first `grn switch`."""
+
+    def __init__(self):
+        super(GrnRestoreCommand, self).__init__("grn restore", gdb.COMMAND_STACK)
+
+    def invoke(self, arg, from_tty):
+        global saved_regs
+        if saved_regs is None:
+            raise gdb.GdbError("not switched into a green thread")
+        for reg, value in saved_regs.items():
+            gdb.execute("set $%s = %#x" % (reg, value), to_string=True)
+        saved_regs = None
+        gdb.execute("frame 0")
+
+
+GrnCommand()
+GrnThreadsCommand()
+GrnSwitchCommand()
+GrnRestoreCommand()